@@ -0,0 +1,134 @@
+#pragma once
+
+/* The C API of ragg, giving compiled code in other packages a way to draw many
+ * elements on the current ragg device with a single call instead of one device
+ * callback per element, and to open devices that render directly into memory
+ * they own. Add ragg to LinkingTo (and Imports) and include this header.
+ *
+ * All coordinates are in device units (pixels with the origin in the top-left
+ * corner) and colours are R colour integers (as given by e.g. RGBpar()). The
+ * functions return 0 on success and 1 if the current device is not a ragg
+ * device. Drawing through this API bypasses the graphics engine, so nothing is
+ * recorded on the display list and it will not be redrawn on replay.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+/* Draw n strings using a single font. family, face (1: plain, 2: bold,
+ * 3: italic, 4: bold-italic, 5: symbol), and size (in points) are interpreted
+ * like the fontfamily, fontface and ps * cex fields of the graphics context.
+ * rot (in degrees) and hadj may be NULL in which case they are 0 for all
+ * strings. NULL strings are skipped. The font is only loaded once and
+ * identical strings are only shaped once.
+ */
+static inline int ragg_draw_text(int n, const char **str, const double *x,
+                                 const double *y, const double *rot,
+                                 const double *hadj, const int *col,
+                                 const char *family, int face, double size) {
+  static int (*p_ragg_draw_text)(int, const char **, const double *,
+                                 const double *, const double *, const double *,
+                                 const int *, const char *, int, double) = NULL;
+  if (p_ragg_draw_text == NULL) {
+    p_ragg_draw_text = (int (*)(int, const char **, const double *,
+                                const double *, const double *, const double *,
+                                const int *, const char *, int, double))
+      R_GetCCallable("ragg", "ragg_draw_text");
+  }
+  return p_ragg_draw_text(n, str, x, y, rot, hadj, col, family, face, size);
+}
+
+/* Draw n circles, e.g. as points. r is the radius of each circle. fill and col
+ * give the fill and stroke colour of each circle and may be NULL in which case
+ * no circle is filled or stroked respectively. lwd is the line width (in
+ * 1/96 inch, like the lwd field of the graphics context) used for all strokes.
+ */
+static inline int ragg_draw_points(int n, const double *x, const double *y,
+                                   const double *r, const int *fill,
+                                   const int *col, double lwd) {
+  static int (*p_ragg_draw_points)(int, const double *, const double *,
+                                   const double *, const int *, const int *,
+                                   double) = NULL;
+  if (p_ragg_draw_points == NULL) {
+    p_ragg_draw_points = (int (*)(int, const double *, const double *,
+                                  const double *, const int *, const int *,
+                                  double))
+      R_GetCCallable("ragg", "ragg_draw_points");
+  }
+  return p_ragg_draw_points(n, x, y, r, fill, col, lwd);
+}
+
+/* Draw n line segments from (x0, y0) to (x1, y1), each with its own colour and
+ * line width. lend is the line end used for all segments (1: round, 2: butt,
+ * 3: square).
+ */
+static inline int ragg_draw_segments(int n, const double *x0, const double *y0,
+                                     const double *x1, const double *y1,
+                                     const int *col, const double *lwd,
+                                     int lend) {
+  static int (*p_ragg_draw_segments)(int, const double *, const double *,
+                                     const double *, const double *,
+                                     const int *, const double *, int) = NULL;
+  if (p_ragg_draw_segments == NULL) {
+    p_ragg_draw_segments = (int (*)(int, const double *, const double *,
+                                    const double *, const double *,
+                                    const int *, const double *, int))
+      R_GetCCallable("ragg", "ragg_draw_segments");
+  }
+  return p_ragg_draw_segments(n, x0, y0, x1, y1, col, lwd, lend);
+}
+
+/* Draw n rectangles with opposite corners (x0, y0) and (x1, y1). fill, col,
+ * and lwd are interpreted as for ragg_draw_points().
+ */
+static inline int ragg_draw_rects(int n, const double *x0, const double *y0,
+                                  const double *x1, const double *y1,
+                                  const int *fill, const int *col,
+                                  double lwd) {
+  static int (*p_ragg_draw_rects)(int, const double *, const double *,
+                                  const double *, const double *, const int *,
+                                  const int *, double) = NULL;
+  if (p_ragg_draw_rects == NULL) {
+    p_ragg_draw_rects = (int (*)(int, const double *, const double *,
+                                 const double *, const double *, const int *,
+                                 const int *, double))
+      R_GetCCallable("ragg", "ragg_draw_rects");
+  }
+  return p_ragg_draw_rects(n, x0, y0, x1, y1, fill, col, lwd);
+}
+
+/* Pixel formats for ragg_device_buffer(). Colours are premultiplied by alpha
+ * and the names give the byte order in memory.
+ */
+#define RAGG_PIXFMT_RGBA 0
+#define RAGG_PIXFMT_BGRA 1
+#define RAGG_PIXFMT_RGB 2
+
+/* Open a new device (which becomes the current device) that renders directly
+ * into data instead of a buffer of its own, so frames can be used without
+ * copying them, e.g. when data is a texture staging buffer. data must hold
+ * height rows of stride bytes (negative if the rows are stored bottom-up) in
+ * the given pixel format and must stay valid until the device is closed. It is
+ * cleared to bg when the device opens and to the page background on every new
+ * page. pointsize, res, scaling and snap
+ * have the same meaning as the arguments of agg_capture() and name is the
+ * device name (agg_buffer if NULL). Returns 1 if the arguments are invalid.
+ */
+static inline int ragg_device_buffer(unsigned char *data, int width,
+                                     int height, int stride, int format,
+                                     double pointsize, int bg, double res,
+                                     double scaling, int snap,
+                                     const char *name) {
+  static int (*p_ragg_device_buffer)(unsigned char *, int, int, int, int,
+                                     double, int, double, double, int,
+                                     const char *) = NULL;
+  if (p_ragg_device_buffer == NULL) {
+    p_ragg_device_buffer = (int (*)(unsigned char *, int, int, int, int,
+                                    double, int, double, double, int,
+                                    const char *))
+      R_GetCCallable("ragg", "ragg_device_buffer");
+  }
+  return p_ragg_device_buffer(data, width, height, stride, format, pointsize,
+                              bg, res, scaling, snap, name);
+}
@@ -6,6 +6,9 @@
 #include "RenderBuffer.h"
 #include "pattern.h"
 #include "group.h"
+#include "damage.h"
+#include "page_store.h"
+#include "page_workers.h"
 
 #include "agg_math_stroke.h"
 
@@ -45,7 +48,7 @@ class AggDevice {
   UTF_UCS converter;
 public:
   typedef PIXFMT pixfmt_type;
-  typedef agg::renderer_base<pixfmt_type> renbase_type;
+  typedef DamageRenderer<pixfmt_type> renbase_type;
   typedef agg::renderer_scanline_aa_solid<renbase_type> renderer_solid;
   typedef agg::renderer_scanline_bin_solid<renbase_type> renderer_bin;
 
@@ -67,9 +70,13 @@ public:
   pixfmt_type* pixf;
   agg::rendering_buffer rbuf;
   unsigned char* buffer;
+  bool external_buffer;
 
   int pageno;
   bool changed;
+  PageQueue page_queue;
+  // Set if pages are kept in memory rather than written to file
+  PageStorePtr page_store;
   std::string file;
   R_COLOR background;
   int background_int;
@@ -110,8 +117,11 @@ public:
   virtual void newPage(unsigned int bg);
   void close();
   virtual bool savePage();
+  virtual bool encodePage(agg::rendering_buffer& frame, int page);
+  void writePage();
   SEXP capture();
   int hold_flush(int level);
+  void attachBuffer(unsigned char* data, int stride);
 
   // Behaviour
   void clipRect(double x0, double y0, double x1, double y1);
@@ -152,8 +162,20 @@ public:
                   bool interpolate);
   void drawText(double x, double y, const char *str, const char *family,
                 int face, double size, double rot, double hadj, int col);
+  void drawTextBulk(int n, const char **str, const double *x, const double *y,
+                    const double *rot, const double *hadj, const int *col,
+                    const char *family, int face, double size);
   void drawGlyph(int n, int *glyphs, double *x, double *y, SEXP font,
                  double size, int colour, double rot);
+  void drawCirclesBulk(int n, const double *x, const double *y,
+                       const double *r, const int *fill, const int *col,
+                       double lwd);
+  void drawSegmentsBulk(int n, const double *x0, const double *y0,
+                        const double *x1, const double *y1, const int *col,
+                        const double *lwd, R_GE_lineend lend);
+  void drawRectsBulk(int n, const double *x0, const double *y0,
+                     const double *x1, const double *y1, const int *fill,
+                     const int *col, double lwd);
   void renderPath(SEXP path, bool do_fill, bool do_stroke, int col, int fill,
                   double lwd, int lty, R_GE_lineend lend, R_GE_linejoin ljoin,
                   double lmitre, bool evenodd, int pattern);
@@ -206,6 +228,51 @@ protected:
       dash_conv.add_dash(dash, gap);
     }
   }
+  // Set up a circle with the number of points chosen from its radius
+  void initCircle(agg::ellipse &e, double x, double y, double r) {
+    if (r < 1) {
+      r = r < 0.5 ? 0.5 : r;
+      e.init(x, y, r, r, 4);
+    } else if (r < 2.5) {
+      e.init(x, y, r, r, 8);
+    } else if (r < 5) {
+      e.init(x, y, r, r, 16);
+    } else if (r < 10) {
+      e.init(x, y, r, r, 32);
+    } else if (r < 20) {
+      e.init(x, y, r, r, 64);
+    } else {
+      e.init(x, y, r, r);
+    }
+  }
+  void initRect(agg::path_storage &rect, double x0, double y0, double x1,
+                double y1, bool snap) {
+    if (snap) {
+      x0 = std::round(x0);
+      x1 = std::round(x1);
+      y0 = std::round(y0);
+      y1 = std::round(y1);
+    }
+    rect.remove_all();
+    rect.move_to(x0, y0);
+    rect.line_to(x0, y1);
+    rect.line_to(x1, y1);
+    rect.line_to(x1, y0);
+    rect.close_polygon();
+  }
+  // Add the current clipping path to a clip rasterizer. Returns whether
+  // clipping applies
+  template<class Raster>
+  bool initClip(Raster &ras_clip) {
+    if (current_clip == NULL) {
+      return false;
+    }
+    ras_clip.add_path(*current_clip);
+    if (current_clip_rule_is_evenodd) {
+      ras_clip.filling_rule(agg::fill_even_odd);
+    }
+    return true;
+  }
   template<class Raster, class Path>
   void setStroke(Raster &ras, Path &p, int lty, double lwd, R_GE_lineend lend, R_GE_linejoin ljoin, double lmitre) {
     if (lty == LTY_SOLID) {
@@ -331,17 +398,15 @@ protected:
   void drawShape(Raster &ras, Raster &ras_clip, Path &path, bool draw_fill,
                  bool draw_stroke, int fill, int col, double lwd,
                  int lty, R_GE_lineend lend, R_GE_linejoin ljoin = GE_ROUND_JOIN,
-                 double lmitre = 1.0, int pattern = -1, bool evenodd = false) {
+                 double lmitre = 1.0, int pattern = -1, bool evenodd = false,
+                 bool add_clip = true) {
     agg::scanline_p8 slp;
     if (recording_path != NULL) {
       recording_path->concat_path(path);
       return;
     }
-    if (current_clip != NULL) {
-      ras_clip.add_path(*current_clip);
-      if (current_clip_rule_is_evenodd) {
-        ras_clip.filling_rule(agg::fill_even_odd);
-      }
+    if (add_clip) {
+      initClip(ras_clip);
     }
 
     if (pattern != -1) {
@@ -510,6 +575,7 @@ AggDevice<PIXFMT, R_COLOR, BLNDFMT>::AggDevice(const char* fp, int w, int h, dou
   recording_group(NULL)
 {
   buffer = new unsigned char[width * height * bytes_per_pixel];
+  external_buffer = false;
   rbuf = agg::rendering_buffer(buffer, width, height, width * bytes_per_pixel);
   pixf = new pixfmt_type(rbuf);
   renderer = renbase_type(*pixf);
@@ -520,7 +586,9 @@ AggDevice<PIXFMT, R_COLOR, BLNDFMT>::AggDevice(const char* fp, int w, int h, dou
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
 AggDevice<PIXFMT, R_COLOR, BLNDFMT>::~AggDevice() {
   delete pixf;
-  delete [] buffer;
+  if (!external_buffer) {
+    delete [] buffer;
+  }
 }
 
 /* newPage() should not need to be overwritten as long the class have an
@@ -530,9 +598,7 @@ AggDevice<PIXFMT, R_COLOR, BLNDFMT>::~AggDevice() {
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
 void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::newPage(unsigned int bg) {
   if (pageno != 0) {
-    if (!savePage()) {
-      Rf_warning("agg could not write to the given file");
-    }
+    writePage();
   }
   renderer.reset_clipping(true);
   if (visibleColour(bg)) {
@@ -546,9 +612,9 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::newPage(unsigned int bg) {
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
 void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::close() {
   if (pageno == 0) pageno++;
-  if (!savePage()) {
-    Rf_warning("agg could not write to the given file");
-  }
+  writePage();
+  page_queue.wait(0);
+  page_queue.report();
 }
 
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
@@ -562,6 +628,23 @@ int AggDevice<PIXFMT, R_COLOR, BLNDFMT>::hold_flush(int level) {
   return hold_level;
 }
 
+/* Make the device render into memory it doesn't own, e.g. a buffer provided by
+ * an embedding application. The memory must hold height rows of stride bytes
+ * and outlive the device. A negative stride means that the rows are stored
+ * bottom-up. The buffer is cleared to the background colour
+ */
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::attachBuffer(unsigned char* data,
+                                                       int stride) {
+  if (!external_buffer) {
+    delete [] buffer;
+  }
+  buffer = data;
+  external_buffer = true;
+  rbuf.attach(buffer, width, height, stride);
+  renderer.clear(background);
+}
+
 /* This takes care of writing the buffer to an appropriate file. The filename
  * may be specified as a printf string with room for a page counter, so the
  * method should take care of resolving that together with the pageno field.
@@ -571,6 +654,43 @@ bool AggDevice<PIXFMT, R_COLOR, BLNDFMT>::savePage() {
   return true;
 }
 
+/* Devices supporting asynchronous writing implement this to encode a page from
+ * the given frame rather than the device buffer, and set the depth of their
+ * page queue. It is called from worker threads and must not use the R API.
+ * Failures should be recorded with page_queue.fail()
+ */
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+bool AggDevice<PIXFMT, R_COLOR, BLNDFMT>::encodePage(agg::rendering_buffer& frame,
+                                                     int page) {
+  return true;
+}
+
+/* Write the finished page. If pages are written asynchronously the buffer is
+ * handed over to a worker thread and drawing continues in a spare buffer,
+ * which is cleared by the following newPage() call
+ */
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::writePage() {
+  if (!page_queue.enabled() || external_buffer) {
+    bool ok = savePage();
+    page_queue.report();
+    if (!ok) {
+      Rf_warning("agg could not write to the given file");
+    }
+    return;
+  }
+  page_queue.report();
+  int stride = width * bytes_per_pixel;
+  unsigned char* frame = buffer;
+  buffer = page_queue.acquire(size_t(stride) * height);
+  rbuf.attach(buffer, width, height, stride);
+  int page = pageno;
+  page_queue.submit([this, frame, stride, page]() {
+    agg::rendering_buffer frame_buf(frame, width, height, stride);
+    return encodePage(frame_buf, page);
+  }, frame, page);
+}
+
 
 // BEHAVIOUR -------------------------------------------------------------------
 
@@ -624,12 +744,12 @@ double AggDevice<PIXFMT, R_COLOR, BLNDFMT>::stringWidth(const char *str,
 #endif
 
   size *= res_mod;
-  agg::glyph_rendering gren = agg::glyph_ren_agg_gray8;
-  if (!t_ren.load_font(gren, family, face, size, device_id)) {
+  double width = 0.0;
+  if (!t_ren.string_width(str, family, face, size, device_id, width)) {
     return 0.0;
   }
 
-  return t_ren.get_text_width(str);
+  return width;
 }
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
 void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::charMetric(int c, const char *family, int face,
@@ -650,15 +770,11 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::charMetric(int c, const char *family,
   }
 
   size *= res_mod;
-  agg::glyph_rendering gren = agg::glyph_ren_agg_gray8;
-  if (!t_ren.load_font(gren, family, face, size, device_id)) {
+  if (!t_ren.char_metric(c, family, face, size, device_id, ascent, descent, width)) {
     *ascent = 0.0;
     *descent = 0.0;
     *width = 0.0;
-    return;
   }
-
-  t_ren.get_char_metric(c, ascent, descent, width);
 }
 
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
@@ -1138,22 +1254,7 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawCircle(double x, double y, double
   agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
   ras.clip_box(clip_left, clip_top, clip_right, clip_bottom);
   agg::ellipse e1;
-  x += x_trans;
-  y += y_trans;
-  if (r < 1) {
-    r = r < 0.5 ? 0.5 : r;
-    e1.init(x, y, r, r, 4);
-  } else if (r < 2.5) {
-    e1.init(x, y, r, r, 8);
-  } else if (r < 5) {
-    e1.init(x, y, r, r, 16);
-  } else if (r < 10) {
-    e1.init(x, y, r, r, 32);
-  } else if (r < 20) {
-    e1.init(x, y, r, r, 64);
-  } else {
-    e1.init(x, y, r, r);
-  }
+  initCircle(e1, x + x_trans, y + y_trans, r);
 
   drawShape(ras, ras_clip, e1, draw_fill, draw_stroke, fill, col, lwd, lty, lend, GE_ROUND_JOIN, 1.0, pattern);
 }
@@ -1175,22 +1276,8 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawRect(double x0, double y0, double
   agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
   ras.clip_box(clip_left, clip_top, clip_right, clip_bottom);
   agg::path_storage rect;
-  x0 += x_trans;
-  x1 += x_trans;
-  y0 += y_trans;
-  y1 += y_trans;
-  if (snap_rect && draw_fill && !draw_stroke) {
-    x0 = std::round(x0);
-    x1 = std::round(x1);
-    y0 = std::round(y0);
-    y1 = std::round(y1);
-  }
-  rect.remove_all();
-  rect.move_to(x0, y0);
-  rect.line_to(x0, y1);
-  rect.line_to(x1, y1);
-  rect.line_to(x1, y0);
-  rect.close_polygon();
+  initRect(rect, x0 + x_trans, y0 + y_trans, x1 + x_trans, y1 + y_trans,
+           snap_rect && draw_fill && !draw_stroke);
 
   drawShape(ras, ras_clip, rect, draw_fill, draw_stroke, fill, col, lwd, lty, lend, ljoin, lmitre, pattern);
 }
@@ -1432,7 +1519,7 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawText(double x, double y, const cha
   }
 #endif
 
-  agg::glyph_rendering gren = std::fmod(rot, 90) == 0.0 && recording_path == NULL ? agg::glyph_ren_agg_gray8 : agg::glyph_ren_outline;
+  agg::glyph_rendering gren = recording_path == NULL ? agg::glyph_ren_agg_gray8 : agg::glyph_ren_outline;
 
   x += x_trans;
   y += y_trans;
@@ -1444,12 +1531,7 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawText(double x, double y, const cha
   }
 
   agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
-  if (current_clip != NULL) {
-    ras_clip.add_path(*current_clip);
-    if (current_clip_rule_is_evenodd) {
-      ras_clip.filling_rule(agg::fill_even_odd);
-    }
-  }
+  initClip(ras_clip);
 
   agg::scanline_u8 slu;
   if (recording_mask == NULL && recording_raster == NULL) {
@@ -1504,12 +1586,209 @@ void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawText(double x, double y, const cha
   }
 }
 
+/* Draws n strings with the same font in one go. This is not used by the
+ * graphics engine but by the bulk drawing API (see bulk_api.h) and follows the
+ * same code paths as drawText() except that the font and clipping are only
+ * set up once
+ */
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawTextBulk(int n, const char **str,
+                                                       const double *x,
+                                                       const double *y,
+                                                       const double *rot,
+                                                       const double *hadj,
+                                                       const int *col,
+                                                       const char *family,
+                                                       int face, double size) {
+  if (n <= 0) {
+    return;
+  }
+  std::vector<const char*> strings(str, str + n);
+#if R_VERSION >= R_Version(4, 0, 0)
+  if (face == 5) {
+    for (int i = 0; i < n; ++i) {
+      if (strings[i] != NULL) strings[i] = Rf_utf8Toutf8NoPUA(strings[i]);
+    }
+  }
+#endif
+  std::vector<double> x_dev(n);
+  std::vector<double> y_dev(n);
+  for (int i = 0; i < n; ++i) {
+    x_dev[i] = x[i] + x_trans;
+    y_dev[i] = y[i] + y_trans;
+  }
+
+  agg::glyph_rendering gren = recording_path == NULL ? agg::glyph_ren_agg_gray8 : agg::glyph_ren_outline;
+
+  size *= res_mod;
+
+  if (!t_ren.load_font(gren, family, face, size, device_id)) {
+    return;
+  }
+
+  agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
+  if (current_clip != NULL) {
+    ras_clip.add_path(*current_clip);
+    if (current_clip_rule_is_evenodd) {
+      ras_clip.filling_rule(agg::fill_even_odd);
+    }
+  }
+
+  agg::scanline_u8 slu;
+  if (recording_mask == NULL && recording_raster == NULL) {
+    changed = true;
+    auto set_colour = [&](int c) { solid_renderer.color(convertColour(c)); };
+    if (current_mask == NULL) {
+      t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, solid_renderer, renderer, slu, device_id, ras_clip, current_clip != NULL, recording_path);
+    } else {
+      if (current_mask->use_luminance()) {
+        t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, solid_renderer, renderer, current_mask->get_masked_scanline_l(), device_id, ras_clip, current_clip != NULL, recording_path);
+      } else {
+        t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, solid_renderer, renderer, current_mask->get_masked_scanline_a(), device_id, ras_clip, current_clip != NULL, recording_path);
+      }
+    }
+  } else if (recording_raster == NULL) {
+    auto set_colour = [&](int c) { recording_mask->set_colour(convertMaskCol(c)); };
+    if (current_mask == NULL) {
+      t_ren.template plot_text_bulk<pixfmt_type_32>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_mask->get_solid_renderer(), recording_mask->get_renderer(), slu, device_id, ras_clip, current_clip != NULL, recording_path);
+    } else {
+      if (current_mask->use_luminance()) {
+        t_ren.template plot_text_bulk<pixfmt_type_32>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_mask->get_solid_renderer(), recording_mask->get_renderer(), current_mask->get_masked_scanline_l(), device_id, ras_clip, current_clip != NULL, recording_path);
+      } else {
+        t_ren.template plot_text_bulk<pixfmt_type_32>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_mask->get_solid_renderer(), recording_mask->get_renderer(), current_mask->get_masked_scanline_a(), device_id, ras_clip, current_clip != NULL, recording_path);
+      }
+    }
+  } else {
+    auto set_colour = [&](int c) { recording_raster->set_colour(convertColour(c)); };
+    if (current_mask == NULL) {
+      if (recording_raster->custom_blend) {
+        t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer_blend(), slu, device_id, ras_clip, current_clip != NULL, recording_path);
+      } else {
+        t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer(), slu, device_id, ras_clip, current_clip != NULL, recording_path);
+      }
+    } else {
+      if (recording_raster->custom_blend) {
+        if (current_mask->use_luminance()) {
+          t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer_blend(), current_mask->get_masked_scanline_l(), device_id, ras_clip, current_clip != NULL, recording_path);
+        } else {
+          t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer_blend(), current_mask->get_masked_scanline_a(), device_id, ras_clip, current_clip != NULL, recording_path);
+        }
+      } else {
+        if (current_mask->use_luminance()) {
+          t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer(), current_mask->get_masked_scanline_l(), device_id, ras_clip, current_clip != NULL, recording_path);
+        } else {
+          t_ren.template plot_text_bulk<BLNDFMT>(n, strings.data(), x_dev.data(), y_dev.data(), rot, hadj, col, set_colour, recording_raster->get_solid_renderer(), recording_raster->get_renderer(), current_mask->get_masked_scanline_a(), device_id, ras_clip, current_clip != NULL, recording_path);
+        }
+      }
+    }
+    if (recording_group != NULL) {
+      recording_group->do_blend(MAX_CELLS);
+    }
+  }
+}
+
+/* The bulk geometry methods below are used by the bulk drawing API (see
+ * bulk_api.h) and draw each element like the corresponding single element
+ * method, except that the rasterizers, the clipping path, and the path storage
+ * are set up once and reused for all elements. fill and col may be NULL in
+ * which case no element is filled or stroked respectively
+ */
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawCirclesBulk(int n,
+                                                          const double *x,
+                                                          const double *y,
+                                                          const double *r,
+                                                          const int *fill,
+                                                          const int *col,
+                                                          double lwd) {
+  if (n <= 0) return;
+
+  lwd *= lwd_mod;
+
+  agg::rasterizer_scanline_aa<> ras(MAX_CELLS);
+  agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
+  ras.clip_box(clip_left, clip_top, clip_right, clip_bottom);
+  if (recording_path == NULL) initClip(ras_clip);
+  agg::ellipse e1;
+  for (int i = 0; i < n; ++i) {
+    bool draw_fill = fill != NULL && visibleColour(fill[i]);
+    bool draw_stroke = col != NULL && visibleColour(col[i]) && lwd > 0.0;
+    if (!draw_fill && !draw_stroke) continue;
+
+    ras.reset();
+    initCircle(e1, x[i] + x_trans, y[i] + y_trans, r[i]);
+    drawShape(ras, ras_clip, e1, draw_fill, draw_stroke,
+              draw_fill ? fill[i] : 0, draw_stroke ? col[i] : 0, lwd,
+              LTY_SOLID, GE_ROUND_CAP, GE_ROUND_JOIN, 1.0, -1, false, false);
+  }
+}
+
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawSegmentsBulk(int n,
+                                                           const double *x0,
+                                                           const double *y0,
+                                                           const double *x1,
+                                                           const double *y1,
+                                                           const int *col,
+                                                           const double *lwd,
+                                                           R_GE_lineend lend) {
+  if (n <= 0) return;
+
+  agg::rasterizer_scanline_aa<> ras(MAX_CELLS);
+  agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
+  ras.clip_box(clip_left, clip_top, clip_right, clip_bottom);
+  if (recording_path == NULL) initClip(ras_clip);
+  agg::path_storage ps;
+  for (int i = 0; i < n; ++i) {
+    if (!visibleColour(col[i]) || lwd[i] <= 0.0) continue;
+
+    ras.reset();
+    ps.remove_all();
+    ps.move_to(x0[i] + x_trans, y0[i] + y_trans);
+    ps.line_to(x1[i] + x_trans, y1[i] + y_trans);
+    drawShape(ras, ras_clip, ps, false, true, 0, col[i], lwd[i] * lwd_mod,
+              LTY_SOLID, lend, GE_ROUND_JOIN, 1.0, -1, false, false);
+  }
+}
+
+template<class PIXFMT, class R_COLOR, typename BLNDFMT>
+void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawRectsBulk(int n,
+                                                        const double *x0,
+                                                        const double *y0,
+                                                        const double *x1,
+                                                        const double *y1,
+                                                        const int *fill,
+                                                        const int *col,
+                                                        double lwd) {
+  if (n <= 0) return;
+
+  lwd *= lwd_mod;
+
+  agg::rasterizer_scanline_aa<> ras(MAX_CELLS);
+  agg::rasterizer_scanline_aa<> ras_clip(MAX_CELLS);
+  ras.clip_box(clip_left, clip_top, clip_right, clip_bottom);
+  if (recording_path == NULL) initClip(ras_clip);
+  agg::path_storage rect;
+  for (int i = 0; i < n; ++i) {
+    bool draw_fill = fill != NULL && visibleColour(fill[i]);
+    bool draw_stroke = col != NULL && visibleColour(col[i]) && lwd > 0.0;
+    if (!draw_fill && !draw_stroke) continue;
+
+    ras.reset();
+    initRect(rect, x0[i] + x_trans, y0[i] + y_trans, x1[i] + x_trans,
+             y1[i] + y_trans, snap_rect && draw_fill && !draw_stroke);
+    drawShape(ras, ras_clip, rect, draw_fill, draw_stroke,
+              draw_fill ? fill[i] : 0, draw_stroke ? col[i] : 0, lwd,
+              LTY_SOLID, GE_ROUND_CAP, GE_MITRE_JOIN, 10.0, -1, false, false);
+  }
+}
+
 template<class PIXFMT, class R_COLOR, typename BLNDFMT>
 void AggDevice<PIXFMT, R_COLOR, BLNDFMT>::drawGlyph(int n, int *glyphs,
                                                     double *x, double *y,
                                                     SEXP font, double size,
                                                     int colour, double rot) {
-  agg::glyph_rendering gren = std::fmod(rot, 90) == 0.0 && recording_path == NULL ? agg::glyph_ren_agg_gray8 : agg::glyph_ren_outline;
+  agg::glyph_rendering gren = recording_path == NULL ? agg::glyph_ren_agg_gray8 : agg::glyph_ren_outline;
 
   int i;
   for (i=0; i<n; i++) {
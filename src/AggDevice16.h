@@ -4,13 +4,6 @@
 #include "AggDevice.h"
 #include "util/agg_color_conv.h"
 
-/* For htons */
-#ifdef _WIN32
-#include <winsock.h>
-#else
-#include <arpa/inet.h>
-#endif
-
 // Functor for dimming alpha if needed
 struct AlphaDim {
   double alpha_mod;
@@ -36,13 +29,6 @@ public:
       this->background = convertColour(this->background_int);
       this->renderer.clear(this->background);
   }
-    
-  void to_bigend() {
-    uint16_t * buf =  reinterpret_cast<uint16_t *>(this->buffer);
-    for (int i = 0; i < this->width * this->height * PIXFMT::num_components; i++) {
-      buf[i] = htons(buf[i]);
-    }
-  }
   
 private:
   inline agg::rgba16 convertColour(unsigned int col) {
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+
+#include "ragg.h"
+#include "AggDevice.h"
+#include "AggDevicePng.h"
+#include "files.h"
+#include "frame_diff.h"
+#include "row_convert.h"
+
+// Store a value in big endian byte order, as used throughout PNG files
+inline unsigned char* png_put_be(unsigned char* out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out[i] = (unsigned char) (value >> (8 * (bytes - i - 1)));
+  }
+  return out + bytes;
+}
+
+/* A palette shared by all frames of an animation. As frames are written as
+ * they are finished, colours are added when they first appear, so the indices
+ * of earlier frames stay valid. Once all 256 entries are used, further colours
+ * are replaced by the nearest entry. Entries hold straight RGBA
+ */
+class ApngPalette {
+  std::unordered_map<uint32_t, uint8_t> entries;
+
+public:
+  int size;
+  uint8_t colours[256][4];
+  // Set once a colour had to be replaced by the nearest entry
+  bool approximated;
+
+  ApngPalette() : size(0), approximated(false) {
+    std::memset(colours, 0, sizeof(colours));
+  }
+
+  // Convert a row of straight RGB(A) pixels to indices
+  void index_row(const unsigned char* in, unsigned char* out, int n, int n_comp) {
+    uint32_t last_key = 0;
+    uint8_t last_index = 0;
+    for (int x = 0; x < n; ++x, in += n_comp) {
+      uint32_t k = uint32_t(in[0]) | (uint32_t(in[1]) << 8) |
+        (uint32_t(in[2]) << 16) | (uint32_t(n_comp == 4 ? in[3] : 255) << 24);
+      if (x == 0 || k != last_key) {
+        last_key = k;
+        last_index = lookup(k);
+      }
+      out[x] = last_index;
+    }
+  }
+
+private:
+  uint8_t lookup(uint32_t k) {
+    auto it = entries.find(k);
+    if (it != entries.end()) {
+      return it->second;
+    }
+    uint8_t c[4] = {uint8_t(k), uint8_t(k >> 8), uint8_t(k >> 16), uint8_t(k >> 24)};
+    uint8_t index;
+    if (size < 256) {
+      index = size++;
+      std::memcpy(colours[index], c, 4);
+    } else {
+      index = nearest(c);
+      approximated = true;
+    }
+    entries[k] = index;
+    return index;
+  }
+
+  uint8_t nearest(const uint8_t* c) const {
+    int best = 0;
+    int best_dist = std::numeric_limits<int>::max();
+    for (int i = 0; i < size; ++i) {
+      int dist = 0;
+      for (int j = 0; j < 4; ++j) {
+        int d = int(colours[i][j]) - int(c[j]);
+        dist += d * d;
+      }
+      if (dist < best_dist) {
+        best = i;
+        best_dist = dist;
+      }
+    }
+    return best;
+  }
+};
+
+/* Writes each rendered page as a frame of a single animated PNG. The chunks are
+ * written directly rather than through libpng, which doesn't support APNG, and
+ * the image data is filtered and deflated by PngDeflate with the settings used
+ * by agg_png(). The file header is written when the device is opened and every
+ * frame is appended as fcTL and IDAT/fdAT chunks as FrameSequence hands it
+ * over, replacing the pixels it covers on the canvas. With a shared palette,
+ * the PLTE and tRNS chunks are written as placeholders holding all 256 entries
+ * and filled in on close(), along with the number of frames in the acTL chunk
+ */
+template <class PIXFMT>
+class AggDeviceApng : public AggDevice<PIXFMT> {
+  static constexpr int N_COMP = PIXFMT::num_components;
+  // Frame delays are stored in 16 bits, as milliseconds
+  static constexpr int MAX_DELAY = 0xFFFF;
+  // Offsets of the chunks filled in on close()
+  static constexpr long ACTL_OFFSET = 8 + 25;
+  static constexpr long PLTE_OFFSET = ACTL_OFFSET + 20;
+
+  typedef FrameSequence<unsigned char> frames_type;
+
+ public:
+  AggDeviceApng(const char* fp, int w, int h, double pointsize, int background,
+                double res, double scaling, bool snap_rect,
+                int comp = PNG_COMPRESS_DEFAULT, bool pal = false,
+                int delay = 100, int n_loop = 0)
+      : AggDevice<PIXFMT>(fp, w, h, pointsize, background, res, scaling,
+                          snap_rect),
+        compression(comp),
+        palette(pal),
+        loop_count(n_loop),
+        fd(make_file(fp, "wb")),
+        frames(w, h, N_COMP, delay, MAX_DELAY),
+        sequence(0),
+        frames_written(0) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    bool ok = std::fwrite(signature, 1, 8, fd.get()) == 8;
+
+    unsigned char ihdr[13];
+    unsigned char* out = png_put_be(ihdr, w, 4);
+    out = png_put_be(out, h, 4);
+    *out++ = 8;
+    *out++ = palette ? 3 : N_COMP == 4 ? 6 : 2;
+    *out++ = 0; // Deflate
+    *out++ = 0; // Adaptive filtering
+    *out++ = 0; // No interlacing
+    ok = ok && write_chunk("IHDR", ihdr, sizeof(ihdr));
+
+    // Placeholders for the chunks filled in on close()
+    unsigned char actl[8] = {0};
+    ok = ok && write_chunk("acTL", actl, sizeof(actl));
+    if (palette) {
+      unsigned char entries[768] = {0};
+      ok = ok && write_chunk("PLTE", entries, 768);
+      if (N_COMP == 4) {
+        ok = ok && write_chunk("tRNS", entries, 256);
+      }
+    }
+
+    // Write in physical dimensions
+    unsigned char phys[9];
+    uint32_t ppm = this->res_real / 0.0254;
+    out = png_put_be(phys, ppm, 4);
+    out = png_put_be(out, ppm, 4);
+    *out = 1; // Meter
+    ok = ok && write_chunk("pHYs", phys, sizeof(phys));
+
+    if (!ok) {
+      throw std::runtime_error("Failed to write APNG header");
+    }
+  }
+
+  bool savePage() {
+    AggDevice<PIXFMT>::savePage();
+
+    try {
+      size_t row_bytes = size_t(this->width) * N_COMP;
+      unsigned char* pixels = frames.page();
+      for (int y = 0; y < this->height; ++y) {
+        unsigned char* row = pixels + y * row_bytes;
+        if (N_COMP == 4) {
+          demultiply_row_rgba8(this->rbuf.row_ptr(y), row, this->width);
+        } else {
+          std::memcpy(row, this->rbuf.row_ptr(y), row_bytes);
+        }
+      }
+
+      FrameRect rect;
+      if (!frames.changed(rect)) {
+        return true;
+      }
+
+      // Rows of the rectangle are converted to the layout of the file on the
+      // fly. Palette indices are looked up on the calling thread
+      ApngPalette* indices = palette ? &shared_palette : NULL;
+      auto get_row = [pixels, row_bytes, rect, indices](int y, unsigned char* out) {
+        const unsigned char* in = pixels + (rect.y + y) * row_bytes + size_t(rect.x) * N_COMP;
+        if (indices) {
+          indices->index_row(in, out, rect.width, N_COMP);
+        } else {
+          std::memcpy(out, in, size_t(rect.width) * N_COMP);
+        }
+      };
+      int bpp = palette ? 1 : N_COMP;
+      std::vector<unsigned char> data;
+      PngDeflate deflater = png_deflate(compression, palette, rect.height,
+                                        size_t(rect.width) * bpp, bpp);
+      if (!deflater.compress(get_row, 1, data)) {
+        Rf_warning("Failed to compress APNG frame");
+        return false;
+      }
+
+      auto write = [this](const frames_type::Frame& frame) {
+        return write_frame(frame);
+      };
+      if (!frames.add(data, rect, write)) {
+        Rf_warning("Failed to write APNG frame %d", frames_written + 1);
+        return false;
+      }
+
+      if (shared_palette.approximated && !warned) {
+        Rf_warning("More than 256 colours used in the animation. Remaining colours are replaced by the closest palette colour");
+        warned = true;
+      }
+      return true;
+
+    } catch (const std::exception& e) {
+      Rf_warning("Exception in savePage: %s", e.what());
+      return false;
+    }
+  }
+
+  void close() {
+    if (!savePage()) {
+      throw std::runtime_error("Failed to encode final APNG frame");
+    }
+
+    if (frames.empty()) {
+      throw std::runtime_error("APNG animation has no frames to write");
+    }
+
+    if (!write_frame(frames.last()) || !write_chunk("IEND", NULL, 0)) {
+      throw std::runtime_error("Failed to write APNG frame " +
+                               std::to_string(frames_written + 1));
+    }
+
+    unsigned char actl[8];
+    png_put_be(png_put_be(actl, frames_written, 4), loop_count, 4);
+    bool ok = std::fseek(fd.get(), ACTL_OFFSET, SEEK_SET) == 0 &&
+      write_chunk("acTL", actl, sizeof(actl));
+    if (palette) {
+      unsigned char entries[768];
+      for (int i = 0; i < 256; ++i) {
+        std::memcpy(entries + 3 * i, shared_palette.colours[i], 3);
+      }
+      ok = ok && std::fseek(fd.get(), PLTE_OFFSET, SEEK_SET) == 0 &&
+        write_chunk("PLTE", entries, 768);
+      if (N_COMP == 4) {
+        for (int i = 0; i < 256; ++i) {
+          entries[i] = shared_palette.colours[i][3];
+        }
+        ok = ok && write_chunk("tRNS", entries, 256);
+      }
+    }
+    if (!ok || std::fflush(fd.get()) != 0) {
+      throw std::runtime_error("Failed to write APNG file");
+    }
+
+    if (this->pageno == 0) {
+      this->pageno = 1;
+    }
+  }
+
+ private:
+  bool write_chunk(const char* type, const unsigned char* data, size_t size) {
+    unsigned char header[8];
+    std::memcpy(png_put_be(header, uint32_t(size), 4), type, 4);
+    uLong crc = crc32(0L, header + 4, 4);
+    if (size > 0) {
+      crc = crc32(crc, data, uInt(size));
+    }
+    unsigned char footer[4];
+    png_put_be(footer, uint32_t(crc), 4);
+    return std::fwrite(header, 1, 8, fd.get()) == 8 &&
+      (size == 0 || std::fwrite(data, 1, size, fd.get()) == size) &&
+      std::fwrite(footer, 1, 4, fd.get()) == 4;
+  }
+
+  // Append a frame as an fcTL chunk followed by its image data. The first
+  // frame is the default image and is stored in IDAT chunks
+  bool write_frame(const frames_type::Frame& frame) {
+    unsigned char fctl[26];
+    unsigned char* out = png_put_be(fctl, sequence++, 4);
+    out = png_put_be(out, frame.rect.width, 4);
+    out = png_put_be(out, frame.rect.height, 4);
+    out = png_put_be(out, frame.rect.x, 4);
+    out = png_put_be(out, frame.rect.y, 4);
+    out = png_put_be(out, frame.duration, 2);
+    out = png_put_be(out, 1000, 2);
+    *out++ = 0; // APNG_DISPOSE_OP_NONE
+    *out++ = 0; // APNG_BLEND_OP_SOURCE
+    if (!write_chunk("fcTL", fctl, sizeof(fctl))) {
+      return false;
+    }
+
+    std::vector<unsigned char> chunk;
+    for (size_t i = 0; i < frame.data.size(); i += PNG_DEFLATE_BLOCK) {
+      size_t n = std::min(PNG_DEFLATE_BLOCK, frame.data.size() - i);
+      if (frames_written == 0) {
+        if (!write_chunk("IDAT", frame.data.data() + i, n)) {
+          return false;
+        }
+      } else {
+        chunk.resize(4 + n);
+        png_put_be(chunk.data(), sequence++, 4);
+        std::memcpy(chunk.data() + 4, frame.data.data() + i, n);
+        if (!write_chunk("fdAT", chunk.data(), chunk.size())) {
+          return false;
+        }
+      }
+    }
+    frames_written++;
+    return true;
+  }
+
+  const int compression;
+  const bool palette;
+  const int loop_count;
+  FilePtr fd;
+  frames_type frames;
+  uint32_t sequence;
+  int frames_written;
+  bool warned = false;
+  ApngPalette shared_palette;
+};
+
+typedef AggDeviceApng<pixfmt_type_24> AggDeviceApngNoAlpha;
+typedef AggDeviceApng<pixfmt_type_32> AggDeviceApngAlpha;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ragg.h"
+#include "AggDeviceCapture.h"
+
+// Pixel formats of caller-supplied buffers. These must match the RAGG_PIXFMT_*
+// constants in inst/include/ragg_api.h
+enum BufferFormat {
+  BUFFER_RGBA = 0,
+  BUFFER_BGRA = 1,
+  BUFFER_RGB = 2
+};
+
+/* A device rendering directly into memory owned by the caller (see
+ * ragg_device_buffer() in buffer_dev.cpp). Nothing is written on page flush,
+ * the caller reads the memory whenever it sees fit. The device can still be
+ * captured as it behaves like agg_capture() otherwise
+ */
+template<class PIXFMT>
+class AggDeviceBuffer : public AggDeviceCapture<PIXFMT> {
+public:
+  AggDeviceBuffer(unsigned char* data, int stride, int w, int h, double ps,
+                  int bg, double res, double scaling, bool snap) :
+    AggDeviceCapture<PIXFMT>("", w, h, ps, bg, res, scaling, snap)
+  {
+    this->attachBuffer(data, stride);
+  }
+};
+
+typedef AggDeviceBuffer<pixfmt_type_32> AggDeviceBufferRGBA;
+typedef AggDeviceBuffer<agg::pixfmt_bgra32_pre> AggDeviceBufferBGRA;
+typedef AggDeviceBuffer<pixfmt_type_24> AggDeviceBufferRGB;
@@ -4,6 +4,8 @@
 #include "ragg.h"
 #include "AggDevice.h"
 
+#include <algorithm>
+
 template<class PIXFMT>
 class AggDeviceCapture : public AggDevice<PIXFMT> {
 public:
@@ -20,17 +22,59 @@ public:
     return true;
   }
   SEXP capture() {
-    SEXP raster = PROTECT(Rf_allocVector(INTSXP, this->width * this->height));
-    agg::rendering_buffer caprbuf(reinterpret_cast<agg::int8u*>(INTEGER(raster)),
-                                  this->width, this->height, this->width * 4);
-    agg::convert<pixfmt_r_raster, pixfmt_type_32>(&caprbuf, &this->rbuf);
-    SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
-    INTEGER(dims)[0] = this->height;
-    INTEGER(dims)[1] = this->width;
-    Rf_setAttrib(raster, R_DimSymbol, dims);
+    SEXP raster = PROTECT(capture_region(0, 0, this->width, this->height, false));
     Rf_setAttrib(raster, Rf_mkString("page"), Rf_ScalarInteger(this->pageno));
     Rf_setAttrib(raster, Rf_mkString("changed"), Rf_ScalarLogical(this->changed));
     this->changed = false;
+    this->renderer.damage().reset();
+    UNPROTECT(1);
+    return raster;
+  }
+  // Capture the part of the buffer that has been drawn to since the last full
+  // capture or capture of changes. Returns NULL if nothing has been drawn
+  SEXP capture_changes() {
+    DamageRect& damage = this->renderer.damage();
+    if (damage.empty()) {
+      return R_NilValue;
+    }
+    SEXP raster = PROTECT(capture_region(damage.x1, damage.y1,
+                                         damage.x2 - damage.x1,
+                                         damage.y2 - damage.y1));
+    Rf_setAttrib(raster, Rf_mkString("page"), Rf_ScalarInteger(this->pageno));
+    damage.reset();
+    UNPROTECT(1);
+    return raster;
+  }
+  // Capture a rectangle of the buffer, given by its top-left corner and size.
+  // The rectangle is limited to the buffer and, if requested, its final
+  // position is stored in the offset attribute
+  SEXP capture_region(int x, int y, int w, int h, bool with_offset = true) {
+    int x2 = std::min(x + w, this->width);
+    int y2 = std::min(y + h, this->height);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+    w = std::max(x2 - x, 0);
+    h = std::max(y2 - y, 0);
+
+    SEXP raster = PROTECT(Rf_allocVector(INTSXP, w * h));
+    if (w > 0 && h > 0) {
+      agg::rendering_buffer caprbuf(reinterpret_cast<agg::int8u*>(INTEGER(raster)),
+                                    w, h, w * 4);
+      agg::rendering_buffer region(this->rbuf.row_ptr(y) + x * this->bytes_per_pixel,
+                                   w, h, this->rbuf.stride());
+      agg::convert<pixfmt_r_raster, PIXFMT>(&caprbuf, &region);
+    }
+    SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(dims)[0] = h;
+    INTEGER(dims)[1] = w;
+    Rf_setAttrib(raster, R_DimSymbol, dims);
+    if (with_offset) {
+      SEXP offset = PROTECT(Rf_allocVector(INTSXP, 2));
+      INTEGER(offset)[0] = x;
+      INTEGER(offset)[1] = y;
+      Rf_setAttrib(raster, Rf_install("offset"), offset);
+      UNPROTECT(1);
+    }
     UNPROTECT(2);
     return raster;
   }
@@ -4,6 +4,9 @@
 #include "AggDevice.h"
 #include "files.h"
 
+#include <cstdlib>
+#include <vector>
+
 #define TRUE 1
 #define FALSE 0
 #include <jpeglib.h>
@@ -21,14 +24,12 @@ public:
   smoothing(smooth),
   method(meth)
   {
-    
+    this->page_queue.depth(async_page_depth());
   }
   // Behaviour
   void newPage(unsigned int bg) {
     if (this->pageno != 0) {
-      if (!savePage()) {
-        Rf_warning("agg could not write to the given file");
-      }
+      this->writePage();
     }
     this->renderer.reset_clipping(true);
     // Fill background with white first to avoid weird transparency issues
@@ -42,17 +43,38 @@ public:
     this->pageno++;
   };
   bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    FILE* fd = unicode_fopen(buf, "wb");
-    if(!fd) return false;
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    // Pages are either written to file or kept in memory
+    FILE* fd = NULL;
+    unsigned char* memory = NULL;
+    unsigned long memory_size = 0;
+    if (!this->page_store) {
+      char buf[PATH_MAX+1];
+      snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+      fd = unicode_fopen(buf, "wb");
+      if(!fd) return false;
+    }
+#if !(JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED))
+    else {
+      this->page_queue.fail("In-memory JPEG output requires libjpeg 8 or libjpeg-turbo");
+      return false;
+    }
+#endif
     
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr       jerr;
     
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, fd);
+    if (fd) {
+      jpeg_stdio_dest(&cinfo, fd);
+    } else {
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+      jpeg_mem_dest(&cinfo, &memory, &memory_size);
+#endif
+    }
     
     cinfo.image_width       = this->width;
     cinfo.image_height      = this->height;
@@ -77,7 +99,7 @@ public:
     jpeg_start_compress(&cinfo, TRUE);
     
     agg::row_ptr_cache<unsigned char> buffer_rows(
-        this->buffer, this->width, this->height, this->rbuf.stride_abs()
+        frame.buf(), this->width, this->height, frame.stride_abs()
     );
     
     JSAMPROW row_pointer;
@@ -87,9 +109,18 @@ public:
     }
     
     jpeg_finish_compress(&cinfo);
-    fclose(fd);
+    if (fd) {
+      fclose(fd);
+    }
     jpeg_destroy_compress(&cinfo);
     
+    // The memory destination allocates with malloc() and leaves freeing to us
+    if (memory) {
+      std::vector<unsigned char> data(memory, memory + memory_size);
+      free(memory);
+      this->page_store->add(page, data);
+    }
+    
     return true;
   };
 };
@@ -8,70 +8,286 @@ extern "C" {
 #include "AggDevice.h"
 #include "AggDevice16.h"
 #include "files.h"
+#include "png_deflate.h"
+#include "png_palette.h"
+#include "row_convert.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <zlib.h>
+
+// Apply a zlib compression level or one of the presets in PngCompression.
+// Indexed images are not filtered, as filtering rarely helps them
+inline void set_png_compression(png_structp png, int compression,
+                                bool indexed) {
+  switch (compression) {
+  case PNG_COMPRESS_DEFAULT:
+    break;
+  case PNG_COMPRESS_FAST:
+    png_set_compression_level(png, 1);
+    png_set_compression_strategy(png, Z_RLE);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE,
+                   indexed ? PNG_FILTER_NONE : PNG_FILTER_SUB);
+    break;
+  case PNG_COMPRESS_SMALL:
+    png_set_compression_level(png, 9);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE,
+                   indexed ? PNG_FILTER_NONE : PNG_ALL_FILTERS);
+    break;
+  default:
+    png_set_compression_level(png, compression);
+    if (compression == 0) {
+      png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    }
+    break;
+  }
+}
+
+// The deflate settings of set_png_compression(), including the libpng
+// defaults, for compressing image data with PngDeflate
+inline PngDeflate png_deflate(int compression, bool indexed, int height,
+                              size_t row_bytes, int bpp) {
+  int level = Z_DEFAULT_COMPRESSION;
+  int strategy = Z_DEFAULT_STRATEGY;
+  int filter = indexed ? PNG_ROW_FILTER_NONE : PNG_ROW_FILTER_ADAPTIVE;
+  switch (compression) {
+  case PNG_COMPRESS_DEFAULT:
+    break;
+  case PNG_COMPRESS_FAST:
+    level = 1;
+    strategy = Z_RLE;
+    if (!indexed) filter = PNG_ROW_FILTER_SUB;
+    break;
+  case PNG_COMPRESS_SMALL:
+    level = 9;
+    break;
+  default:
+    level = compression;
+    if (compression == 0) filter = PNG_ROW_FILTER_NONE;
+    break;
+  }
+  // libpng switches to the filtered strategy whenever rows are filtered
+  if (strategy == Z_DEFAULT_STRATEGY && filter != PNG_ROW_FILTER_NONE) {
+    strategy = Z_FILTERED;
+  }
+  return PngDeflate(height, row_bytes, bpp, filter, level, strategy);
+}
+
+/* Writes the image data of a PNG after png_write_info() has been called. The
+ * rows are passed through libpng one at a time, unless more than one thread is
+ * allowed and the image is large enough to be split into several blocks. In
+ * that case the data is filtered and compressed by PngDeflate and written as
+ * ready-made IDAT chunks, followed by the IEND chunk. The scratch memory is
+ * held here so that it is freed even if libpng jumps out on an error
+ */
+class PngImageData {
+  std::vector<unsigned char> row;
+  std::vector<unsigned char> idat;
+  std::unique_ptr<PngDeflate> deflater;
+
+public:
+  template<class ROW_FUN>
+  bool write(png_structp png, int height, size_t row_bytes, int bpp,
+             int compression, bool indexed, int threads,
+             const ROW_FUN& get_row) {
+    if (threads < 2 || size_t(height) * row_bytes < 2 * PNG_DEFLATE_BLOCK) {
+      row.resize(row_bytes);
+      for (int y = 0; y < height; ++y) {
+        get_row(y, row.data());
+        png_write_row(png, row.data());
+      }
+      png_write_end(png, NULL);
+      return true;
+    }
+    deflater.reset(new PngDeflate(png_deflate(compression, indexed, height, row_bytes, bpp)));
+    if (!deflater->compress(get_row, threads, idat)) {
+      return false;
+    }
+    for (size_t i = 0; i < idat.size(); i += PNG_DEFLATE_BLOCK) {
+      size_t n = std::min(PNG_DEFLATE_BLOCK, idat.size() - i);
+      png_write_chunk(png, (png_const_bytep) "IDAT", idat.data() + i, n);
+    }
+    png_write_chunk(png, (png_const_bytep) "IEND", NULL, 0);
+    return true;
+  }
+};
+
+// libpng output callbacks collecting the file in memory. A flush function must
+// be given as the default one expects a FILE
+inline void png_write_memory(png_structp png, png_bytep data, png_size_t length) {
+  std::vector<unsigned char>* out = (std::vector<unsigned char>*) png_get_io_ptr(png);
+  bool failed = false;
+  try {
+    out->insert(out->end(), data, data + length);
+  } catch (...) {
+    failed = true;
+  }
+  if (failed) {
+    png_error(png, "Could not grow the memory buffer");
+  }
+}
+inline void png_flush_memory(png_structp png) {}
+
+// Releases the libpng structs and closes the file of a write that failed
+inline bool png_write_failed(png_structp* png, png_infop* info, FILE* fd) {
+  png_destroy_write_struct(png, *info ? info : NULL);
+  if (fd) fclose(fd);
+  return false;
+}
 
 template<class PIXFMT>
 class AggDevicePng : public AggDevice<PIXFMT> {
+  typedef PngPalette<PIXFMT::num_components> palette_type;
+
+  int compression;
+  bool palette;
+  int quantize;
+  int threads;
 public:
-  AggDevicePng(const char* fp, int w, int h, double ps, int bg, double res, double scaling, bool snap) : 
-    AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap)
+  AggDevicePng(const char* fp, int w, int h, double ps, int bg, double res, double scaling, bool snap,
+               int comp = PNG_COMPRESS_DEFAULT, bool pal = false, int quant = 0,
+               int n_threads = 1) : 
+    AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
+    compression(comp),
+    palette(pal),
+    quantize(quant),
+    threads(n_threads)
   {
-    
+    this->page_queue.depth(async_page_depth());
   }
   
   // Behaviour
   bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    FILE* fd = unicode_fopen(buf, "wb");
-    if(!fd) return false;
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    // Pages are either written to file or kept in memory
+    std::vector<unsigned char> memory;
+    FILE* fd = NULL;
+    if (!this->page_store) {
+      char buf[PATH_MAX+1];
+      snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+      fd = unicode_fopen(buf, "wb");
+      if(!fd) return false;
+    }
+    
+    // Write an indexed image if the page has few enough colours
+    std::unique_ptr<palette_type> pal;
+    if (palette) {
+      pal.reset(new palette_type());
+      if (!pal->build(frame, quantize)) {
+        pal.reset();
+      }
+    }
     
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) return false;
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) return png_write_failed(&png, &info, fd);
     
-    png_infop info = png_create_info_struct(png);
-    if (!info) return false;
+    PngImageData data;
     
-    if (setjmp(png_jmpbuf(png))) return false;
+    if (setjmp(png_jmpbuf(png))) return png_write_failed(&png, &info, fd);
     
-    png_init_io(png, fd);
+    if (fd) {
+      png_init_io(png, fd);
+    } else {
+      png_set_write_fn(png, &memory, png_write_memory, png_flush_memory);
+    }
+    set_png_compression(png, compression, pal != nullptr);
     
-    png_set_IHDR(
-      png,
-      info,
-      this->width, this->height,
-      8,
-      PIXFMT::num_components == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA,
-      PNG_INTERLACE_NONE,
-      PNG_COMPRESSION_TYPE_DEFAULT,
-      PNG_FILTER_TYPE_DEFAULT
-    );
+    if (pal) {
+      png_set_IHDR(
+        png,
+        info,
+        this->width, this->height,
+        pal->bit_depth(),
+        PNG_COLOR_TYPE_PALETTE,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+      );
+      png_color colours[256];
+      for (int i = 0; i < pal->size; ++i) {
+        colours[i].red = pal->red[i];
+        colours[i].green = pal->green[i];
+        colours[i].blue = pal->blue[i];
+      }
+      png_set_PLTE(png, info, colours, pal->size);
+      if (pal->n_trans > 0) {
+        png_set_tRNS(png, info, pal->alpha, pal->n_trans, NULL);
+      }
+    } else {
+      png_set_IHDR(
+        png,
+        info,
+        this->width, this->height,
+        8,
+        PIXFMT::num_components == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+      );
+    }
     
     // Write in physical dimensions
     unsigned int ppm = this->res_real / 0.0254;
     png_set_pHYs(png, info, ppm, ppm, 1);
     
-    // Write prefered background, just because...
+    // Write prefered background, just because... Indexed images can only
+    // refer to a palette entry
     png_color_16 background;
     background.red = this->background.r;
     background.green = this->background.g;
     background.blue = this->background.b;
-    png_set_bKGD(png, info, &background);
+    if (pal) {
+      // Demultiply with the same rounding as the palette entries
+      agg::rgba8 bg_col = this->background;
+      if (PIXFMT::num_components == 4) {
+        bg_col.r = agg::rgba8::demultiply(bg_col.r, bg_col.a);
+        bg_col.g = agg::rgba8::demultiply(bg_col.g, bg_col.a);
+        bg_col.b = agg::rgba8::demultiply(bg_col.b, bg_col.a);
+      } else {
+        bg_col.a = 255;
+      }
+      int index = pal->find(bg_col.r, bg_col.g, bg_col.b, bg_col.a);
+      if (index >= 0) {
+        background.index = index;
+        png_set_bKGD(png, info, &background);
+      }
+    } else {
+      png_set_bKGD(png, info, &background);
+    }
     
     png_write_info(png, info);
     
-    demultiply<PIXFMT>(this->pixf);
-    
-    agg::row_ptr_cache<unsigned char> buffer_rows(
-        this->buffer, this->width, this->height, this->rbuf.stride_abs()
-    );
-    
-    png_write_image(png, (png_byte **) buffer_rows.rows());
-    png_write_end(png, NULL);
+    // Rows are converted to the layout of the file on the fly
+    const palette_type* indices = pal.get();
+    int w = this->width;
+    auto get_row = [&frame, indices, w](int y, unsigned char* out) {
+      if (indices) {
+        indices->index_row(frame.row_ptr(y), out, w);
+      } else if (PIXFMT::num_components == 4) {
+        demultiply_row_rgba8(frame.row_ptr(y), out, w);
+      } else {
+        std::memcpy(out, frame.row_ptr(y), size_t(w) * 3);
+      }
+    };
+    size_t row_bytes = pal ? (size_t(w) * pal->bit_depth() + 7) / 8 : size_t(w) * PIXFMT::pix_width;
+    int bpp = pal ? 1 : PIXFMT::pix_width;
+    bool ok = data.write(png, this->height, row_bytes, bpp, compression,
+                         pal != nullptr, threads, get_row);
     
     png_destroy_write_struct(&png, &info);
-    fclose(fd);
+    if (fd) {
+      fclose(fd);
+    } else if (ok) {
+      this->page_store->add(page, memory);
+    }
     
-    return true;
+    return ok;
   }
 };
 
@@ -80,29 +296,47 @@ typedef AggDevicePng<pixfmt_type_32> AggDevicePngAlpha;
 
 template<class PIXFMT>
 class AggDevicePng16 : public AggDevice16<PIXFMT> {
+  int compression;
+  int threads;
 public:
-  AggDevicePng16(const char* fp, int w, int h, double ps, int bg, double res, double scaling, bool snap, double alpha_mod = 1.0) : 
-  AggDevice16<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap, alpha_mod)
+  AggDevicePng16(const char* fp, int w, int h, double ps, int bg, double res, double scaling, bool snap, double alpha_mod = 1.0,
+                 int comp = PNG_COMPRESS_DEFAULT, int n_threads = 1) : 
+  AggDevice16<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap, alpha_mod),
+  compression(comp),
+  threads(n_threads)
   {
-    
+    this->page_queue.depth(async_page_depth());
   }
   
   // Behaviour
   bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    FILE* fd = unicode_fopen(buf, "wb");
-    if(!fd) return false;
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    // Pages are either written to file or kept in memory
+    std::vector<unsigned char> memory;
+    FILE* fd = NULL;
+    if (!this->page_store) {
+      char buf[PATH_MAX+1];
+      snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+      fd = unicode_fopen(buf, "wb");
+      if(!fd) return false;
+    }
     
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) return false;
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) return png_write_failed(&png, &info, fd);
     
-    png_infop info = png_create_info_struct(png);
-    if (!info) return false;
+    PngImageData data;
     
-    if (setjmp(png_jmpbuf(png))) return false;
+    if (setjmp(png_jmpbuf(png))) return png_write_failed(&png, &info, fd);
     
-    png_init_io(png, fd);
+    if (fd) {
+      png_init_io(png, fd);
+    } else {
+      png_set_write_fn(png, &memory, png_write_memory, png_flush_memory);
+    }
+    set_png_compression(png, compression, false);
     
     png_set_IHDR(
       png,
@@ -128,19 +362,28 @@ public:
     
     png_write_info(png, info);
     
-    demultiply<PIXFMT>(this->pixf);
-    this->to_bigend();
-    
-    agg::row_ptr_cache<unsigned char> buffer_rows(
-        this->buffer, this->width, this->height, this->rbuf.stride_abs()
-    );
-    png_write_image(png, (png_byte **) buffer_rows.rows());
-    png_write_end(png, NULL);
+    // PNG stores 16bit samples in big endian byte order
+    int w = this->width;
+    auto get_row = [&frame, w](int y, unsigned char* out) {
+      const uint16_t* samples = (const uint16_t*) frame.row_ptr(y);
+      if (PIXFMT::num_components == 4) {
+        demultiply_row_rgba16_be(samples, out, w);
+      } else {
+        bigend_row16(samples, out, w * PIXFMT::num_components);
+      }
+    };
+    bool ok = data.write(png, this->height, size_t(w) * PIXFMT::pix_width,
+                         PIXFMT::pix_width, compression, false, threads,
+                         get_row);
     
     png_destroy_write_struct(&png, &info);
-    fclose(fd);
+    if (fd) {
+      fclose(fd);
+    } else if (ok) {
+      this->page_store->add(page, memory);
+    }
     
-    return true;
+    return ok;
   }
 };
 
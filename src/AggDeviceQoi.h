@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ragg.h"
+#include "AggDevice.h"
+#include "files.h"
+#include "qoi_encode.h"
+#include "row_convert.h"
+
+#include <vector>
+
+// Amount of encoded data collected before it is written to the file
+static const size_t QOI_WRITE_BUFFER = 1 << 16;
+
+template<class PIXFMT>
+class AggDeviceQoi : public AggDevice<PIXFMT> {
+public:
+  AggDeviceQoi(const char* fp, int w, int h, double ps, int bg, double res, double scaling, bool snap) : 
+  AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap)
+  {
+    this->page_queue.depth(async_page_depth());
+  }
+  
+  // Behaviour
+  bool savePage() {
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    // Pages are either written to file or kept in memory
+    FILE* fd = NULL;
+    if (!this->page_store) {
+      char buf[PATH_MAX+1];
+      snprintf(buf, PATH_MAX, this->file.c_str(), page); buf[PATH_MAX] = '\0';
+      fd = unicode_fopen(buf, "wb");
+      if(!fd) return false;
+    }
+    
+    QoiEncoder encoder(PIXFMT::num_components);
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> row;
+    bool ok = true;
+    try {
+      encoder.header(out, this->width, this->height);
+      // QOI stores straight alpha
+      if (PIXFMT::num_components == 4) {
+        row.resize(size_t(this->width) * 4);
+      }
+      for (int y = 0; y < this->height && ok; ++y) {
+        const unsigned char* in = frame.row_ptr(y);
+        if (PIXFMT::num_components == 4) {
+          demultiply_row_rgba8(in, row.data(), this->width);
+          in = row.data();
+        }
+        encoder.encode_row(in, this->width, out);
+        if (fd && out.size() >= QOI_WRITE_BUFFER) {
+          ok = fwrite(out.data(), 1, out.size(), fd) == out.size();
+          out.clear();
+        }
+      }
+      encoder.finish(out);
+    } catch (...) {
+      ok = false;
+    }
+    
+    if (fd) {
+      ok = ok && fwrite(out.data(), 1, out.size(), fd) == out.size();
+      fclose(fd);
+    } else if (ok) {
+      this->page_store->add(page, out);
+    }
+    
+    return ok;
+  }
+};
+
+typedef AggDeviceQoi<pixfmt_type_24> AggDeviceQoiNoAlpha;
+typedef AggDeviceQoi<pixfmt_type_32> AggDeviceQoiAlpha;
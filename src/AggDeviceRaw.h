@@ -0,0 +1,204 @@
+#pragma once
+
+#include "ragg.h"
+#include "AggDevice.h"
+#include "files.h"
+#include "row_convert.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Frame layouts written by the raw video device. The names follow the pixel
+// formats of ffmpeg's rawvideo demuxer
+enum RawFormat {
+  RAW_RGB24 = 0,
+  RAW_RGBA = 1,
+  RAW_YUV420P = 2
+};
+
+// Upper bound on the memory used for converting a frame before it is written
+static const size_t RAW_CHUNK_BYTES = 1 << 18;
+
+/* A device writing each page as a raw frame to a single stream, ready to be
+ * piped into e.g. `ffmpeg -f rawvideo`. The stream is either a file (which may
+ * be a FIFO) or, if the file name has the form `fd:N`, an already open file
+ * descriptor. Frames are converted in chunks of rows so the memory overhead is
+ * bounded regardless of the frame size. RGB and YUV frames are rendered on an
+ * opaque buffer, while RGBA frames are written with straight alpha
+ */
+template<class PIXFMT>
+class AggDeviceRaw : public AggDevice<PIXFMT> {
+  FILE* stream;
+  int format;
+  std::vector<unsigned char> chunk;
+
+public:
+  AggDeviceRaw(const char* fp, int w, int h, double ps, int bg, double res,
+               double scaling, bool snap, int fmt) :
+    AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
+    stream(NULL),
+    format(fmt)
+  {
+    if (std::strncmp(fp, "fd:", 3) == 0) {
+#ifdef _WIN32
+      int fd = _dup(std::atoi(fp + 3));
+      stream = fd < 0 ? NULL : _fdopen(fd, "wb");
+#else
+      int fd = dup(std::atoi(fp + 3));
+      stream = fd < 0 ? NULL : fdopen(fd, "wb");
+#endif
+    } else {
+      stream = unicode_fopen(fp, "wb");
+    }
+  }
+  ~AggDeviceRaw() {
+    if (stream != NULL) {
+      fclose(stream);
+    }
+  }
+
+  bool is_open() const {
+    return stream != NULL;
+  }
+
+  // Behaviour
+  bool savePage() {
+    if (stream == NULL) {
+      return false;
+    }
+    bool ok;
+    switch (format) {
+    case RAW_YUV420P:
+      ok = write_yuv420p();
+      break;
+    case RAW_RGBA:
+      ok = write_rgba();
+      break;
+    default:
+      ok = write_rows();
+      break;
+    }
+    return fflush(stream) == 0 && ok;
+  }
+
+private:
+  int chunk_rows(size_t row_bytes) {
+    return std::max(1, std::min(this->height, int(RAW_CHUNK_BYTES / row_bytes)));
+  }
+  unsigned char* chunk_buffer(size_t bytes) {
+    if (chunk.size() < bytes) {
+      chunk.resize(bytes);
+    }
+    return chunk.data();
+  }
+
+  // The buffer already has the layout of the frame
+  bool write_rows() {
+    size_t row_bytes = size_t(this->width) * this->bytes_per_pixel;
+    for (int y = 0; y < this->height; ++y) {
+      if (fwrite(this->rbuf.row_ptr(y), 1, row_bytes, stream) != row_bytes) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool write_rgba() {
+    size_t row_bytes = size_t(this->width) * 4;
+    int n_rows = chunk_rows(row_bytes);
+    unsigned char* out = chunk_buffer(row_bytes * n_rows);
+    for (int y = 0; y < this->height; y += n_rows) {
+      int rows = std::min(n_rows, this->height - y);
+      for (int i = 0; i < rows; ++i) {
+        demultiply_row_rgba8(this->rbuf.row_ptr(y + i), out + i * row_bytes, this->width);
+      }
+      if (fwrite(out, 1, row_bytes * rows, stream) != row_bytes * rows) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Planar 4:2:0 with BT.601 limited range coefficients, the default of most
+  // video encoders. Chroma is taken from the average of each 2x2 block
+  bool write_yuv420p() {
+    int w = this->width;
+    int h = this->height;
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+
+    int n_rows = chunk_rows(w);
+    unsigned char* out = chunk_buffer(size_t(w) * n_rows);
+    for (int y = 0; y < h; y += n_rows) {
+      int rows = std::min(n_rows, h - y);
+      for (int i = 0; i < rows; ++i) {
+        luma_row(this->rbuf.row_ptr(y + i), out + i * w, w);
+      }
+      if (fwrite(out, 1, size_t(w) * rows, stream) != size_t(w) * rows) {
+        return false;
+      }
+    }
+
+    n_rows = chunk_rows(cw);
+    out = chunk_buffer(size_t(cw) * n_rows);
+    for (int plane = 0; plane < 2; ++plane) {
+      for (int y = 0; y < ch; y += n_rows) {
+        int rows = std::min(n_rows, ch - y);
+        for (int i = 0; i < rows; ++i) {
+          int y0 = 2 * (y + i);
+          int y1 = std::min(y0 + 1, h - 1);
+          chroma_row(this->rbuf.row_ptr(y0), this->rbuf.row_ptr(y1),
+                     out + i * cw, w, plane == 0);
+        }
+        if (fwrite(out, 1, size_t(cw) * rows, stream) != size_t(cw) * rows) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // The conversion loops below are kept free of branches and divisions so that
+  // they can be vectorised by the compiler
+  static void luma_row(const unsigned char* in, unsigned char* out, int n) {
+    for (int x = 0; x < n; ++x) {
+      int r = in[3 * x];
+      int g = in[3 * x + 1];
+      int b = in[3 * x + 2];
+      out[x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    }
+  }
+  // The chroma coefficients are applied to the sum of each 2x2 block, hence
+  // the extra division by 4
+  static void chroma_row(const unsigned char* in0, const unsigned char* in1,
+                         unsigned char* out, int n, bool u) {
+    const int cr = u ? -38 : 112;
+    const int cg = u ? -74 : -94;
+    const int cb = u ? 112 : -18;
+    int cn = n / 2;
+    for (int x = 0; x < cn; ++x) {
+      int r = in0[6 * x] + in0[6 * x + 3] + in1[6 * x] + in1[6 * x + 3];
+      int g = in0[6 * x + 1] + in0[6 * x + 4] + in1[6 * x + 1] + in1[6 * x + 4];
+      int b = in0[6 * x + 2] + in0[6 * x + 5] + in1[6 * x + 2] + in1[6 * x + 5];
+      out[x] = ((cr * r + cg * g + cb * b + 512) >> 10) + 128;
+    }
+    if (n % 2 == 1) {
+      int last = 3 * (n - 1);
+      int r = 2 * (in0[last] + in1[last]);
+      int g = 2 * (in0[last + 1] + in1[last + 1]);
+      int b = 2 * (in0[last + 2] + in1[last + 2]);
+      out[cn] = ((cr * r + cg * g + cb * b + 512) >> 10) + 128;
+    }
+  }
+};
+
+typedef AggDeviceRaw<pixfmt_type_24> AggDeviceRawNoAlpha;
+typedef AggDeviceRaw<pixfmt_type_32> AggDeviceRawAlpha;
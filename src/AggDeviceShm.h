@@ -0,0 +1,257 @@
+#pragma once
+
+#include "ragg.h"
+#include "AggDeviceCapture.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Size reserved for the header at the start of the file. Frame buffers start
+// right after it
+static const size_t SHARED_FRAME_HEADER_SIZE = 128;
+static const uint32_t SHARED_FRAME_VERSION = 1;
+
+/* The header of a shared frame file. It is followed by two frame buffers of
+ * height rows of stride bytes each, holding premultiplied RGBA pixels. front
+ * is the index of the buffer holding the most recently published frame and
+ * frame counts the published frames. The dirty rectangle is the part of the
+ * frame that changed since the previous one. A reader should read frame before
+ * and after reading the front buffer and discard what it read if the two
+ * differ, as the device may then have started drawing into it. frame is
+ * therefore updated atomically
+ */
+struct SharedFrameHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format;
+  uint32_t n_buffers;
+  uint32_t front;
+  std::atomic<uint64_t> frame;
+  int32_t dirty_x;
+  int32_t dirty_y;
+  int32_t dirty_width;
+  int32_t dirty_height;
+  uint32_t page;
+  uint32_t closed;
+};
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "The frame counter must have the layout of a 64bit integer");
+
+/* A device rendering into a memory mapped file (e.g. in /dev/shm) that another
+ * process can read frames from without any encoding. The device draws into the
+ * back buffer and publishes it whenever a page is finished, the device is
+ * closed, or drawing is flushed with dev.flush(). After publishing, the region
+ * that changed is copied to the other buffer, which then becomes the back
+ * buffer, so that drawing can continue where it left off
+ */
+template<class PIXFMT>
+class AggDeviceShm : public AggDeviceCapture<PIXFMT> {
+  unsigned char* mapping;
+  size_t mapping_size;
+  size_t buffer_size;
+  SharedFrameHeader* header;
+  unsigned int back;
+#ifdef _WIN32
+  HANDLE file_handle;
+  HANDLE map_handle;
+#endif
+
+public:
+  AggDeviceShm(const char* fp, int w, int h, double ps, int bg, double res,
+               double scaling, bool snap) :
+    AggDeviceCapture<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
+    mapping(NULL),
+    mapping_size(0),
+    buffer_size(0),
+    header(NULL),
+    back(0)
+  {
+    int stride = w * this->bytes_per_pixel;
+    buffer_size = size_t(stride) * h;
+    mapping_size = SHARED_FRAME_HEADER_SIZE + 2 * buffer_size;
+    if (!map_file(fp)) {
+      return;
+    }
+
+    std::memset(mapping, 0, SHARED_FRAME_HEADER_SIZE);
+    header = (SharedFrameHeader*) mapping;
+    std::memcpy(header->magic, "RAGGSHM", 8);
+    header->version = SHARED_FRAME_VERSION;
+    header->header_size = SHARED_FRAME_HEADER_SIZE;
+    header->width = w;
+    header->height = h;
+    header->stride = stride;
+    header->format = 0;
+    header->n_buffers = 2;
+
+    // This clears the first buffer, marking all of it as changed so the first
+    // publish brings the second buffer up to date as well
+    this->attachBuffer(frame_buffer(back), stride);
+  }
+  ~AggDeviceShm() {
+    unmap_file();
+  }
+
+  bool is_open() const {
+    return header != NULL;
+  }
+
+  // Behaviour
+  bool savePage() {
+    publish();
+    return true;
+  }
+  void close() {
+    AggDeviceCapture<PIXFMT>::close();
+    if (header != NULL) {
+      header->closed = 1;
+      next_frame();
+    }
+  }
+  int hold_flush(int level) {
+    int new_level = AggDeviceCapture<PIXFMT>::hold_flush(level);
+    if (level < 0 && new_level == 0) {
+      publish();
+    }
+    return new_level;
+  }
+  // Capturing resets the damaged region, but it is still needed to publish the
+  // next frame
+  SEXP capture() {
+    DamageRect damage = this->renderer.damage();
+    SEXP raster = AggDeviceCapture<PIXFMT>::capture();
+    this->renderer.damage() = damage;
+    return raster;
+  }
+
+private:
+  unsigned char* frame_buffer(unsigned int i) {
+    return mapping + SHARED_FRAME_HEADER_SIZE + i * buffer_size;
+  }
+
+  // Announce a new frame. The release store makes the header visible with it,
+  // and the fence keeps the following writes to the old front buffer from
+  // becoming visible before the new count
+  void next_frame() {
+    uint64_t frame = header->frame.load(std::memory_order_relaxed);
+    header->frame.store(frame + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void publish() {
+    DamageRect& damage = this->renderer.damage();
+    if (header == NULL || damage.empty()) {
+      return;
+    }
+    header->dirty_x = damage.x1;
+    header->dirty_y = damage.y1;
+    header->dirty_width = damage.x2 - damage.x1;
+    header->dirty_height = damage.y2 - damage.y1;
+    header->page = this->pageno;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->front = back;
+    next_frame();
+
+    unsigned int next = 1 - back;
+    unsigned char* src = frame_buffer(back);
+    unsigned char* dst = frame_buffer(next);
+    size_t stride = header->stride;
+    size_t offset = damage.x1 * this->bytes_per_pixel;
+    size_t length = (damage.x2 - damage.x1) * this->bytes_per_pixel;
+    for (int y = damage.y1; y < damage.y2; ++y) {
+      std::memcpy(dst + y * stride + offset, src + y * stride + offset, length);
+    }
+    back = next;
+    this->buffer = dst;
+    this->rbuf.attach(dst, this->width, this->height, stride);
+    damage.reset();
+  }
+
+#ifdef _WIN32
+  bool map_file(const char* path) {
+    file_handle = INVALID_HANDLE_VALUE;
+    map_handle = NULL;
+    int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+    if (len <= 0) {
+      return false;
+    }
+    std::vector<wchar_t> path_w(len);
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, path_w.data(), len);
+    file_handle = CreateFileW(path_w.data(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    uint64_t size = mapping_size;
+    map_handle = CreateFileMappingW(file_handle, NULL, PAGE_READWRITE,
+                                    (DWORD) (size >> 32), (DWORD) size, NULL);
+    if (map_handle == NULL) {
+      unmap_file();
+      return false;
+    }
+    mapping = (unsigned char*) MapViewOfFile(map_handle, FILE_MAP_WRITE, 0, 0,
+                                             mapping_size);
+    if (mapping == NULL) {
+      unmap_file();
+      return false;
+    }
+    return true;
+  }
+  void unmap_file() {
+    if (mapping != NULL) {
+      UnmapViewOfFile(mapping);
+      mapping = NULL;
+    }
+    if (map_handle != NULL) {
+      CloseHandle(map_handle);
+      map_handle = NULL;
+    }
+    if (file_handle != INVALID_HANDLE_VALUE) {
+      CloseHandle(file_handle);
+      file_handle = INVALID_HANDLE_VALUE;
+    }
+  }
+#else
+  bool map_file(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (ftruncate(fd, mapping_size) != 0) {
+      ::close(fd);
+      return false;
+    }
+    void* data = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    mapping = (unsigned char*) data;
+    return true;
+  }
+  void unmap_file() {
+    if (mapping != NULL) {
+      munmap(mapping, mapping_size);
+      mapping = NULL;
+    }
+  }
+#endif
+};
+
+typedef AggDeviceShm<pixfmt_type_32> AggDeviceShmAlpha;
@@ -4,157 +4,256 @@
 #include "AggDevice.h"
 #include "AggDevice16.h"
 #include "files.h"
+#include "tiff_encode.h"
 
 #ifdef _WIN32
 #include <io.h>
+#else
+#include <unistd.h>
 #endif
 
 #include <cstdio>
+#include <string>
 #include <tiffio.h>
 
-template<class PIXFMT>
-class AggDeviceTiff : public AggDevice<PIXFMT> {
+// Pages with more image data than this are written as BigTIFF, as offsets in
+// a classic TIFF file are limited to 32bit
+static const double TIFF_CLASSIC_MAX = 4294967295.0 - (1 << 24);
+
+/* Writes the pages of the 8 and 16bit TIFF devices. Pages are stored in
+ * strips, or in square tiles if a tile size is given, and the strips or tiles
+ * can be compressed on several threads. Each page becomes a separate file,
+ * unless all pages should go into a single multi-page file, which is then
+ * kept open until close() is called. If the device has a page store, files
+ * are built in memory and handed to the store once they are complete
+ */
+class TiffWriter {
   int compression;
   int encoding;
+  int tile;
+  bool bigtiff;
+  bool multipage;
+  int threads;
+  TIFF* multi;
+  TiffMemory multi_memory;
+  PageStorePtr multi_store;
+  int multi_page;
+
 public:
-  AggDeviceTiff(const char* fp, int w, int h, double ps, int bg, double res,
-                double scaling, bool snap, int comp = 0, int enc = 0) :
-    AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
+  TiffWriter(int comp, int enc, int tile_size, bool big, bool multi_page,
+             int n_threads) :
     compression(comp),
-    encoding(enc)
-  {
+    encoding(enc),
+    tile(tile_size),
+    bigtiff(big),
+    multipage(multi_page),
+    threads(n_threads),
+    multi(NULL),
+    multi_page(0)
+  {}
+  ~TiffWriter() {
+    if (multi) {
+      TIFFClose(multi);
+    }
+  }
 
+  // Finish the multi-page file. It is only handed to the page store if all of
+  // it could be written
+  bool close() {
+    if (!multi) {
+      return true;
+    }
+    bool ok = TIFFFlush(multi) == 1;
+    TIFFClose(multi);
+    multi = NULL;
+    if (multi_store && ok) {
+      multi_store->add(multi_page, multi_memory.contents());
+    }
+    multi_store.reset();
+    return ok;
   }
 
-  // Behaviour
-  bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    FILE* fd = unicode_fopen(buf, "wb");
-    if(!fd) return false;
+  // Multi-page files are written on the main thread so pages stay in order
+  bool async() const {
+    return !multipage;
+  }
 
-#ifdef _WIN32
-    TIFF *out= TIFFFdOpen(_get_osfhandle(fileno(fd)), buf, "w");
-#else
-    TIFF *out= TIFFFdOpen(fileno(fd), buf, "w");
-#endif
+  bool write(const std::string& file, const PageStorePtr& store,
+             agg::rendering_buffer& frame, int page, int width, int height,
+             int n_comp, int bits, double res) {
+    TiffFormat format = {n_comp, bits, compression, encoding};
+    bool big = bigtiff ||
+      double(width) * height * format.pixel_bytes() > TIFF_CLASSIC_MAX;
 
+    TIFF* out = multi;
+    TiffMemory memory;
     if (!out) {
-      fclose(fd);
-      return false;
+      if (store) {
+        out = multipage ? multi_memory.open(big) : memory.open(big);
+      } else {
+        char buf[PATH_MAX+1];
+        snprintf(buf, PATH_MAX, file.c_str(), page); buf[PATH_MAX] = '\0';
+        out = open(buf, big);
+      }
+      if (!out) return false;
+      if (multipage) {
+        multi = out;
+        multi_store = store;
+        multi_page = page;
+      }
     }
 
     // Image dims
-    TIFFSetField (out, TIFFTAG_IMAGEWIDTH, this->width);
-    TIFFSetField(out, TIFFTAG_IMAGELENGTH, this->height);
-    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, PIXFMT::num_components);
-    if (PIXFMT::num_components == 4) {
-      short extras[] = {EXTRASAMPLE_ASSOCALPHA};
-      TIFFSetField(out, TIFFTAG_EXTRASAMPLES, 1, extras);
-    }
-    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(out, TIFFTAG_IMAGELENGTH, height);
+    format.apply(out);
     TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(out, TIFFTAG_XRESOLUTION, this->res_real);
-    TIFFSetField(out, TIFFTAG_YRESOLUTION, this->res_real);
+    TIFFSetField(out, TIFFTAG_XRESOLUTION, res);
+    TIFFSetField(out, TIFFTAG_YRESOLUTION, res);
     TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, 2); // Inches
+    if (multipage) {
+      TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+      TIFFSetField(out, TIFFTAG_PAGENUMBER, page - 1, 0);
+    }
 
-    // Compression
-    if (compression) TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
-    if (encoding) TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
-
-    // Required
-    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    bool ok = true;
+    if (tile > 0) {
+      TIFFSetField(out, TIFFTAG_TILEWIDTH, tile);
+      TIFFSetField(out, TIFFTAG_TILELENGTH, tile);
+      ok = TiffChunks(format, frame, width, height, tile, 0).write(out, threads);
+    } else if (threads > 1) {
+      int rows = TiffChunks::parallel_rows(width, format);
+      TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rows);
+      ok = TiffChunks(format, frame, width, height, 0, rows).write(out, threads);
+    } else {
+      // Strip equals scanline
+      TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, width * n_comp));
+
+      //Now writing image to the file one strip at a time
+      for (int32_t row = 0; row < height && ok; row++) {
+        ok = TIFFWriteScanline(out, frame.row_ptr(row), row, 0) >= 0;
+      }
+    }
 
-    // Strip equals scanline
-    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, this->width * PIXFMT::num_components));
+    if (multipage) {
+      if (!ok) {
+        // Drop the incomplete page so the next one starts a fresh directory
+        TIFFCreateDirectory(out);
+        return false;
+      }
+      return TIFFWriteDirectory(out);
+    }
+    ok = ok && TIFFFlush(out) == 1;
+    TIFFClose(out);
+    if (store && ok) {
+      store->add(page, memory.contents());
+    }
 
-    agg::row_ptr_cache<unsigned char> buffer_rows(
-        this->buffer, this->width, this->height, this->rbuf.stride_abs()
-    );
+    return ok;
+  }
 
+private:
+  // libtiff reads earlier directories back when linking the pages of a
+  // multi-page file, so the file must be readable as well. libtiff closes the
+  // descriptor it is given in TIFFClose(), so it gets a duplicate and the FILE*
+  // used to open the file is closed right away
+  TIFF* open(const char* path, bool big) {
+    FILE* file = unicode_fopen(path, multipage ? "w+b" : "wb");
+    if(!file) return NULL;
 
-    //Now writing image to the file one strip at a time
-    for (int32_t row = 0; row < this->height; row++) {
-      if (TIFFWriteScanline(out, buffer_rows.row_ptr(row), row, 0) < 0) {
-        (void) TIFFClose(out);
-        return false;
-      }
+    const char* mode = big ? "w8" : "w";
+#ifdef _WIN32
+    HANDLE handle = NULL;
+    BOOL dup_ok = DuplicateHandle(GetCurrentProcess(),
+                                  (HANDLE) _get_osfhandle(fileno(file)),
+                                  GetCurrentProcess(), &handle, 0, FALSE,
+                                  DUPLICATE_SAME_ACCESS);
+    fclose(file);
+    if (!dup_ok) return NULL;
+    TIFF *out= TIFFFdOpen((int) (intptr_t) handle, path, mode);
+    if (!out) {
+      CloseHandle(handle);
     }
+#else
+    int fd = dup(fileno(file));
+    fclose(file);
+    if (fd < 0) return NULL;
+    TIFF *out= TIFFFdOpen(fd, path, mode);
+    if (!out) {
+      ::close(fd);
+    }
+#endif
 
-    (void) TIFFClose(out);
+    return out;
+  }
+};
 
-    return true;
+template<class PIXFMT>
+class AggDeviceTiff : public AggDevice<PIXFMT> {
+  TiffWriter writer;
+public:
+  AggDeviceTiff(const char* fp, int w, int h, double ps, int bg, double res,
+                double scaling, bool snap, int comp = 0, int enc = 0,
+                int tile = 0, bool bigtiff = false, bool multipage = false,
+                int threads = 1) :
+    AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
+    writer(comp, enc, tile, bigtiff, multipage, threads)
+  {
+    if (writer.async()) {
+      this->page_queue.depth(async_page_depth());
+    }
+  }
+
+  // Behaviour
+  bool savePage() {
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    return writer.write(this->file, this->page_store, frame, page, this->width,
+                        this->height, PIXFMT::num_components, 8, this->res_real);
+  }
+  void close() {
+    AggDevice<PIXFMT>::close();
+    if (!writer.close()) {
+      Rf_warning("agg could not write to the given file");
+    }
   }
 };
 
 typedef AggDeviceTiff<pixfmt_type_24> AggDeviceTiffNoAlpha;
 typedef AggDeviceTiff<pixfmt_type_32> AggDeviceTiffAlpha;
 
-// This is more or less a complete copy of the above 8bit implementation,
-// but subclassing AggDevice16. There is probably a better setup
+// The same as above, but subclassing AggDevice16
 
 template<class PIXFMT>
 class AggDeviceTiff16 : public AggDevice16<PIXFMT> {
-  int compression;
-  int encoding;
+  TiffWriter writer;
 public:
   AggDeviceTiff16(const char* fp, int w, int h, double ps, int bg, double res,
-                  double scaling, bool snap, int comp = 0, int enc = 0) :
+                  double scaling, bool snap, int comp = 0, int enc = 0,
+                  int tile = 0, bool bigtiff = false, bool multipage = false,
+                  int threads = 1) :
     AggDevice16<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
-    compression(comp),
-    encoding(enc)
+    writer(comp, enc, tile, bigtiff, multipage, threads)
   {
-
+    if (writer.async()) {
+      this->page_queue.depth(async_page_depth());
+    }
   }
 
   // Behaviour
   bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno); buf[PATH_MAX] = '\0';
-    TIFF *out= TIFFOpen(buf, "w");
-    if (!out) return false;
-
-    // Image dims
-    TIFFSetField (out, TIFFTAG_IMAGEWIDTH, this->width);
-    TIFFSetField(out, TIFFTAG_IMAGELENGTH, this->height);
-    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, PIXFMT::num_components);
-    if (PIXFMT::num_components == 4) {
-      TIFFSetField(out, TIFFTAG_EXTRASAMPLES, EXTRASAMPLE_ASSOCALPHA);
-    }
-    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 16);
-    TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(out, TIFFTAG_XRESOLUTION, this->res_real);
-    TIFFSetField(out, TIFFTAG_YRESOLUTION, this->res_real);
-    TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, 2); // Inches
-
-    // Compression
-    if (compression) TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
-    if (encoding) TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
-
-    // Required
-    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-
-    // Strip equals scanline
-    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, this->width * PIXFMT::num_components));
-
-    agg::row_ptr_cache<unsigned char> buffer_rows(
-        this->buffer, this->width, this->height, this->rbuf.stride_abs()
-    );
-
-
-    //Now writing image to the file one strip at a time
-    for (int32_t row = 0; row < this->height; row++) {
-      if (TIFFWriteScanline(out, buffer_rows.row_ptr(row), row, 0) < 0) {
-        (void) TIFFClose(out);
-        return false;
-      }
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    return writer.write(this->file, this->page_store, frame, page, this->width,
+                        this->height, PIXFMT::num_components, 16, this->res_real);
+  }
+  void close() {
+    AggDevice16<PIXFMT>::close();
+    if (!writer.close()) {
+      Rf_warning("agg could not write to the given file");
     }
-
-    (void) TIFFClose(out);
-
-    return true;
   }
 };
 
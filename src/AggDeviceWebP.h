@@ -7,6 +7,33 @@
 #include "ragg.h"
 #include "AggDevice.h"
 #include "files.h"
+#include "row_convert.h"
+
+// Convert a row of the frame to the straight ARGB pixels used by libwebp
+template<class PIXFMT>
+inline void webp_argb_row(const unsigned char* src, uint32_t* dst, int width) {
+  if (PIXFMT::num_components == 4) {
+    demultiply_row_argb8(src, dst, width);
+  } else {
+    rgb_row_argb8(src, dst, width);
+  }
+}
+
+/* Import a frame into a picture as straight ARGB, converting one row at a time
+ * directly into the picture memory. Importing ARGB rather than RGB(A) also
+ * keeps lossless encoding lossless, as libwebp otherwise converts the pixels
+ * to YUV before encoding. pic must have its dimensions set
+ */
+template<class PIXFMT>
+inline bool import_webp_frame(WebPPicture* pic, agg::rendering_buffer& frame) {
+  pic->use_argb = 1;
+  if (!WebPPictureAlloc(pic)) return false;
+  for (int y = 0; y < pic->height; ++y) {
+    webp_argb_row<PIXFMT>(frame.row_ptr(y), pic->argb + size_t(y) * pic->argb_stride,
+                          pic->width);
+  }
+  return true;
+}
 
 template<class PIXFMT>
 class AggDeviceWebP : public AggDevice<PIXFMT> {
@@ -26,7 +53,9 @@ class AggDeviceWebP : public AggDevice<PIXFMT> {
                 bool los, int qual)
     : AggDevice<PIXFMT>(fp, w, h, ps, bg, res, scaling, snap),
       lossy(los), quality(qual)
-  {}
+  {
+    this->page_queue.depth(async_page_depth());
+  }
 
   static int FileWriter(const uint8_t* data, size_t data_size,
                         const WebPPicture* picture) {
@@ -35,15 +64,23 @@ class AggDeviceWebP : public AggDevice<PIXFMT> {
   }
 
   bool savePage() {
-    char buf[PATH_MAX+1];
-    snprintf(buf, PATH_MAX, this->file.c_str(), this->pageno);
-    buf[PATH_MAX] = '\0';
-
-    auto fd = std::unique_ptr<FILE, decltype(&std::fclose)>(
-        unicode_fopen(buf, "wb"), &std::fclose);
-    if (!fd) return false;
-
-    demultiply<PIXFMT>(this->pixf);
+    return encodePage(this->rbuf, this->pageno);
+  }
+  bool encodePage(agg::rendering_buffer& frame, int page) {
+    // Pages are either written to file or kept in memory
+    auto fd = std::unique_ptr<FILE, decltype(&std::fclose)>(NULL, &std::fclose);
+    WebPMemoryWriter memory;
+    WebPMemoryWriterInit(&memory);
+    auto memory_guard = std::unique_ptr<WebPMemoryWriter, void(*)(WebPMemoryWriter*)>(
+        &memory, [](WebPMemoryWriter* w) { WebPMemoryWriterClear(w); });
+    if (!this->page_store) {
+      char buf[PATH_MAX+1];
+      snprintf(buf, PATH_MAX, this->file.c_str(), page);
+      buf[PATH_MAX] = '\0';
+
+      fd.reset(unicode_fopen(buf, "wb"));
+      if (!fd) return false;
+    }
 
     WebPPicture pic;
     if (!WebPPictureInit(&pic)) return false;
@@ -53,28 +90,35 @@ class AggDeviceWebP : public AggDevice<PIXFMT> {
 
     pic.width = this->width;
     pic.height = this->height;
-    pic.writer = FileWriter;
-    pic.custom_ptr = fd.get();
+    if (fd) {
+      pic.writer = FileWriter;
+      pic.custom_ptr = fd.get();
+    } else {
+      pic.writer = WebPMemoryWrite;
+      pic.custom_ptr = &memory;
+    }
 
     WebPConfig config;
     if (!WebPConfigInit(&config)) return false;
     config.quality = float(quality);
     config.lossless = lossy ? 0 : 1;
 
-    const int stride = this->rbuf.stride_abs();
-    constexpr auto importer = (PIXFMT::num_components == 3)
-        ? WebPPictureImportRGB : WebPPictureImportRGBA;
-
-    if (!importer(&pic, reinterpret_cast<const uint8_t*>(this->buffer), stride)) {
-      Rf_warning("WebPPictureImport failed: %s", webp_error_name(pic.error_code));
+    if (!import_webp_frame<PIXFMT>(&pic, frame)) {
+      this->page_queue.fail(std::string("WebPPictureImport failed: ") +
+                            webp_error_name(pic.error_code));
       return false;
     }
 
     if (!WebPEncode(&config, &pic)) {
-      Rf_warning("WebPEncode failed: %s", webp_error_name(pic.error_code));
+      this->page_queue.fail(std::string("WebPEncode failed: ") +
+                            webp_error_name(pic.error_code));
       return false;
     }
 
+    if (!fd) {
+      std::vector<unsigned char> data(memory.mem, memory.mem + memory.size);
+      this->page_store->add(page, data);
+    }
     return true;
   }
 
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <webp/encode.h>
-#include <webp/mux.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 #include <memory>
@@ -10,26 +12,57 @@
 #include <string>
 
 #include "AggDevice.h"
+#include "AggDeviceWebP.h"
 #include "files.h"
+#include "frame_diff.h"
 #include "ragg.h"
 
-using FilePtr = std::unique_ptr<FILE, int(*)(FILE*)>;
+// Store a value in little endian byte order, as used throughout WebP files
+inline uint8_t* webp_put_le(uint8_t* out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out[i] = uint8_t(value >> (8 * i));
+  }
+  return out + bytes;
+}
 
-inline FilePtr make_file(const char* filename, const char* mode) {
-  FILE* f = unicode_fopen(filename, mode);
-  if (!f) {
-    throw std::runtime_error("Failed to open file");
+/* The chunks of an encoded WebP image that make up the frame data of an ANMF
+ * chunk, i.e. the image data and alpha channel without the RIFF header and the
+ * VP8X chunk. Returns false if the data is not a valid WebP file
+ */
+inline bool webp_frame_data(const uint8_t* data, size_t size,
+                            std::vector<uint8_t>& frame) {
+  if (size < 12 || std::memcmp(data, "RIFF", 4) != 0 ||
+      std::memcmp(data + 8, "WEBP", 4) != 0) {
+    return false;
   }
-  return FilePtr(f, fclose);
+  frame.clear();
+  size_t pos = 12;
+  while (pos + 8 <= size) {
+    size_t chunk = 8 + ((size_t(data[pos + 4]) | size_t(data[pos + 5]) << 8 |
+                         size_t(data[pos + 6]) << 16 | size_t(data[pos + 7]) << 24) + 1) / 2 * 2;
+    if (pos + chunk > size) {
+      return false;
+    }
+    if (std::memcmp(data + pos, "VP8X", 4) != 0) {
+      frame.insert(frame.end(), data + pos, data + pos + chunk);
+    }
+    pos += chunk;
+  }
+  return !frame.empty();
 }
 
-// A variant of AggDeviceWebP that captures each rendered page to memory,
-// encodes it as a WebP frame, and then uses libwebp's mux API to assemble
-// them into a single animated WebP on close().
+// A variant of AggDeviceWebP that writes each rendered page as a frame of a
+// single animated WebP. The RIFF header and animation parameters are written
+// when the device is opened, and every frame is appended to the file as an
+// ANMF chunk as FrameSequence hands it over. The RIFF size is filled in on
+// close()
 template <class PIXFMT>
 class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
  private:
-  static constexpr uint32_t RGB_MASK = 0xFFFFFF;
+  // Frame durations are stored in 24 bits
+  static constexpr int MAX_DURATION = (1 << 24) - 1;
+  // The RIFF size is stored in 32 bits
+  static constexpr uint64_t MAX_RIFF_SIZE = 0xFFFFFFFEu;
 
   static const char* webp_error_name(int error_code) {
     static constexpr const char* errors[] = {"OK", "OUT_OF_MEMORY", "BITSTREAM_OUT_OF_MEMORY",
@@ -40,12 +73,7 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
     return (error_code >= 0 && error_code < num_errors) ? errors[error_code] : "UNKNOWN";
   }
 
-  static const char* mux_error_name(WebPMuxError error_code) {
-    static constexpr const char* errors[] = {"OK", "NOT_FOUND", "INVALID_ARGUMENT", "BAD_DATA",
-                                             "MEMORY_ERROR", "NOT_ENOUGH_DATA"};
-    constexpr int num_errors = sizeof(errors) / sizeof(errors[0]);
-    return (error_code >= 0 && error_code < num_errors) ? errors[error_code] : "UNKNOWN";
-  }
+  typedef FrameSequence<uint32_t> frames_type;
 
  public:
   AggDeviceWebPAnim(const char* fp, int w, int h, double pointsize,
@@ -55,28 +83,54 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
                           snap_rect),
         lossy(los),
         quality(qual),
-        delay_ms(delay),
         loop_count(n_count),
-        mux(WebPMuxNew(), WebPMuxDelete) {
-    if (!mux) {
-      throw std::runtime_error("Failed to create WebP mux");
-    }
+        fd(make_file(fp, "wb")),
+        frames(w, h, 1, delay, MAX_DURATION, 2),
+        riff_size(0) {
+    uint8_t header[12 + 18 + 14];
+    uint8_t* out = header;
+    std::memcpy(out, "RIFF", 4);
+    out = webp_put_le(out + 4, 0, 4);
+    std::memcpy(out, "WEBP", 4);
+    out += 4;
+
+    // Canvas size and flags for animation and (possibly) alpha
+    std::memcpy(out, "VP8X", 4);
+    out = webp_put_le(out + 4, 10, 4);
+    out = webp_put_le(out, PIXFMT::num_components == 4 ? 0x12 : 0x02, 4);
+    out = webp_put_le(out, w - 1, 3);
+    out = webp_put_le(out, h - 1, 3);
 
-    WebPMuxAnimParams params;
-    std::memset(&params, 0, sizeof(params));
-    params.bgcolor = static_cast<uint32_t>(background) & RGB_MASK;
-    params.loop_count = loop_count;
+    // Background colour as blue, green, red, alpha and the loop count
+    std::memcpy(out, "ANIM", 4);
+    out = webp_put_le(out + 4, 6, 4);
+    *out++ = R_BLUE(background);
+    *out++ = R_GREEN(background);
+    *out++ = R_RED(background);
+    *out++ = R_ALPHA(background);
+    out = webp_put_le(out, std::min(loop_count, 0xFFFF), 2);
 
-    if (WebPMuxSetAnimationParams(mux.get(), &params) != WEBP_MUX_OK) {
-      throw std::runtime_error("Failed to set WebP animation parameters");
+    if (!write(header, out - header, false)) {
+      throw std::runtime_error("Failed to write WebP animation header");
     }
+    riff_size = out - header - 8;
   }
 
   bool savePage() {
     AggDevice<PIXFMT>::savePage();
-    demultiply<PIXFMT>(this->pixf);
 
     try {
+      uint32_t* pixels = frames.page();
+      for (int y = 0; y < this->height; ++y) {
+        webp_argb_row<PIXFMT>(this->rbuf.row_ptr(y), pixels + size_t(y) * this->width,
+                              this->width);
+      }
+
+      FrameRect rect;
+      if (!frames.changed(rect)) {
+        return true;
+      }
+
       WebPPicture pic;
       if (!WebPPictureInit(&pic)) {
         Rf_warning("WebPPictureInit failed");
@@ -89,8 +143,9 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
       auto cleanup = [](WebPMemoryWriter* w) { WebPMemoryWriterClear(w); };
       std::unique_ptr<WebPMemoryWriter, decltype(cleanup)> wr_guard(&wr, cleanup);
 
-      pic.width = this->width;
-      pic.height = this->height;
+      pic.width = rect.width;
+      pic.height = rect.height;
+      pic.use_argb = 1;
       pic.writer = WebPMemoryWrite;
       pic.custom_ptr = &wr;
 
@@ -102,26 +157,34 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
       config.quality = float(quality);
       config.lossless = lossy ? 0 : 1;
 
-      const int stride = this->rbuf.stride_abs();
-      const auto importer = (PIXFMT::num_components == 3) ? WebPPictureImportRGB
-                                                          : WebPPictureImportRGBA;
-
-      if (!importer(&pic, reinterpret_cast<const uint8_t*>(this->buffer), stride)) {
-        Rf_warning("WebPPictureImport failed: %s", webp_error_name(pic.error_code));
+      if (!WebPPictureAlloc(&pic)) {
+        Rf_warning("WebPPictureAlloc failed: %s", webp_error_name(pic.error_code));
         return false;
       }
+      for (int y = 0; y < rect.height; ++y) {
+        std::memcpy(pic.argb + size_t(y) * pic.argb_stride,
+                    pixels + size_t(rect.y + y) * this->width + rect.x,
+                    size_t(rect.width) * sizeof(uint32_t));
+      }
 
       if (!WebPEncode(&config, &pic)) {
         Rf_warning("WebPEncode failed: %s", webp_error_name(pic.error_code));
         return false;
       }
 
-      if (wr.size > 0 && wr.mem != nullptr) {
-        frames.emplace_back(wr.mem, wr.mem + wr.size);
-      } else {
+      std::vector<uint8_t> data;
+      if (wr.mem == nullptr || !webp_frame_data(wr.mem, wr.size, data)) {
         Rf_warning("Empty or invalid WebP frame data");
         return false;
       }
+
+      auto write = [this](const frames_type::Frame& frame) {
+        return write_frame(frame);
+      };
+      if (!frames.add(data, rect, write)) {
+        Rf_warning("Failed to write WebP frame %d", frames_written + 1);
+        return false;
+      }
       return true;
 
     } catch (const std::exception& e) {
@@ -139,43 +202,16 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
       throw std::runtime_error("WebP animation has no frames to write");
     }
 
-    for (size_t i = 0; i < frames.size(); ++i) {
-      const auto& raw = frames[i];
-      WebPMuxFrameInfo finfo;
-      std::memset(&finfo, 0, sizeof(finfo));
-      finfo.bitstream.bytes = raw.data();
-      finfo.bitstream.size = raw.size();
-      finfo.duration = delay_ms;
-      finfo.id = WEBP_CHUNK_ANMF;
-      finfo.x_offset = 0;
-      finfo.y_offset = 0;
-      finfo.dispose_method = WEBP_MUX_DISPOSE_NONE;
-      finfo.blend_method = WEBP_MUX_BLEND;
-      WebPMuxError frame_err = WebPMuxPushFrame(mux.get(), &finfo, 1);
-      if (frame_err != WEBP_MUX_OK) {
-        std::string msg = "Failed to push WebP frame " +
-                          std::to_string(i + 1) + "/" +
-                          std::to_string(frames.size()) + ": " +
-                          mux_error_name(frame_err) + " (" +
-                          std::to_string(raw.size()) + " bytes)";
-        throw std::runtime_error(msg);
-      }
-    }
-
-    WebPData out;
-    WebPDataInit(&out);
-    auto out_guard = std::unique_ptr<WebPData, decltype(&WebPDataClear)>(&out, WebPDataClear);
-
-    WebPMuxError mux_err = WebPMuxAssemble(mux.get(), &out);
-    if (mux_err != WEBP_MUX_OK) {
-      std::string msg = "WebP mux assemble failed: " +
-                        std::string(mux_error_name(mux_err)) + " (" +
-                        std::to_string(frames.size()) + " frames)";
-      throw std::runtime_error(msg);
+    if (!write_frame(frames.last())) {
+      throw std::runtime_error("Failed to write WebP frame " +
+                               std::to_string(frames_written + 1));
     }
 
-    auto fd = make_file(this->file.c_str(), "wb");
-    if (fwrite(out.bytes, 1, out.size, fd.get()) != out.size) {
+    uint8_t size[4];
+    webp_put_le(size, uint32_t(riff_size), 4);
+    if (std::fseek(fd.get(), 4, SEEK_SET) != 0 ||
+        std::fwrite(size, 1, 4, fd.get()) != 4 ||
+        std::fflush(fd.get()) != 0) {
       throw std::runtime_error("Failed to write WebP animation file");
     }
 
@@ -185,12 +221,44 @@ class AggDeviceWebPAnim : public AggDevice<PIXFMT> {
   }
 
  private:
+  // Write data to the file, keeping track of the size of the RIFF payload
+  bool write(const uint8_t* data, size_t size, bool count = true) {
+    if (count) {
+      if (riff_size + size > MAX_RIFF_SIZE) {
+        return false;
+      }
+      riff_size += size;
+    }
+    return std::fwrite(data, 1, size, fd.get()) == size;
+  }
+
+  // Append a frame as an ANMF chunk. Frames replace the pixels they cover,
+  // including transparent ones, and are left on the canvas for the following
+  // frames to build on
+  bool write_frame(const frames_type::Frame& frame) {
+    uint8_t header[24];
+    std::memcpy(header, "ANMF", 4);
+    uint8_t* out = webp_put_le(header + 4, uint32_t(16 + frame.data.size()), 4);
+    out = webp_put_le(out, frame.rect.x / 2, 3);
+    out = webp_put_le(out, frame.rect.y / 2, 3);
+    out = webp_put_le(out, frame.rect.width - 1, 3);
+    out = webp_put_le(out, frame.rect.height - 1, 3);
+    out = webp_put_le(out, frame.duration, 3);
+    *out = 0x02; // No blending, no disposal
+    if (!write(header, sizeof(header)) || !write(frame.data.data(), frame.data.size())) {
+      return false;
+    }
+    frames_written++;
+    return true;
+  }
+
   const bool lossy;
   const int quality;
-  const int delay_ms;
   const int loop_count;
-  std::unique_ptr<WebPMux, void(*)(WebPMux*)> mux;
-  std::vector<std::vector<uint8_t>> frames;
+  FilePtr fd;
+  frames_type frames;
+  uint64_t riff_size;
+  int frames_written = 0;
 };
 
 typedef AggDeviceWebPAnim<pixfmt_type_24> AggDeviceWebPAnimNoAlpha;
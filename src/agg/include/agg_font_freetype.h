@@ -89,6 +89,7 @@ namespace agg
         bool        hinting()      const { return m_hinting;    }
         bool        flip_y()       const { return m_flip_y;     }
         unsigned    id()           const { return m_cur_id;     }
+        glyph_rendering rendering() const { return m_glyph_rendering; }
 
 
         // Interface mandatory to implement for font_cache_manager
@@ -98,6 +99,12 @@ namespace agg
 
         unsigned        get_glyph_index(unsigned glyph_code);
         bool            prepare_glyph(unsigned glyph_index);
+        // Load the metrics of a glyph, giving the same bounds as
+        // prepare_glyph(). The glyph is only rasterized if its outline is not
+        // enough to tell the bounds. Only bounds(), advance_x(), advance_y()
+        // and data_type() are valid afterwards and the current transform is
+        // not applied
+        bool            prepare_glyph_metrics(unsigned glyph_index);
         unsigned        glyph_index() const { return m_glyph_index; }
         unsigned        data_size()   const { return m_data_size;   }
         glyph_data_type data_type()   const { return m_data_type;   }
@@ -117,6 +124,7 @@ namespace agg
 
         void update_char_size();
         void update_signature();
+        void rasterize_outline_gray8();
         int  find_face(const char* face_name, unsigned face_index) const;
 
         bool            m_flag32;
@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <cstring>
 #include "agg_font_freetype.h"
+#include FT_BBOX_H
 #include "agg_bitset_iterator.h"
 #include "agg_renderer_scanline.h"
 
@@ -1151,36 +1152,7 @@ namespace agg
             case glyph_ren_agg_gray8:
                 if(m_last_error == 0)
                 {
-                    m_rasterizer.reset();
-                    if(m_flag32)
-                    {
-                        m_path32.remove_all();
-                        decompose_ft_outline(m_cur_face->glyph->outline,
-                                             m_flip_y, 
-                                             m_affine,
-                                             m_path32);
-                        m_rasterizer.add_path(m_curves32);
-                    }
-                    else
-                    {
-                        m_path16.remove_all();
-                        decompose_ft_outline(m_cur_face->glyph->outline,
-                                             m_flip_y, 
-                                             m_affine,
-                                             m_path16);
-                        m_rasterizer.add_path(m_curves16);
-                    }
-                    m_scanlines_aa.prepare(); // Remove all 
-                    render_scanlines(m_rasterizer, m_scanline_aa, m_scanlines_aa);
-                    m_bounds.x1 = m_scanlines_aa.min_x();
-                    m_bounds.y1 = m_scanlines_aa.min_y();
-                    m_bounds.x2 = m_scanlines_aa.max_x() + 1;
-                    m_bounds.y2 = m_scanlines_aa.max_y() + 1;
-                    m_data_size = m_scanlines_aa.byte_size(); 
-                    m_data_type = glyph_data_gray8;
-                    m_advance_x = int26p6_to_dbl(m_cur_face->glyph->advance.x);
-                    m_advance_y = int26p6_to_dbl(m_cur_face->glyph->advance.y);
-                    m_affine.transform(&m_advance_x, &m_advance_y);
+                    rasterize_outline_gray8();
                     return true;
                 }
                 return false;
@@ -1192,6 +1164,113 @@ namespace agg
 
 
 
+    //------------------------------------------------------------------------
+    void font_engine_freetype_base::rasterize_outline_gray8()
+    {
+        m_rasterizer.reset();
+        if(m_flag32)
+        {
+            m_path32.remove_all();
+            decompose_ft_outline(m_cur_face->glyph->outline,
+                                 m_flip_y, 
+                                 m_affine,
+                                 m_path32);
+            m_rasterizer.add_path(m_curves32);
+        }
+        else
+        {
+            m_path16.remove_all();
+            decompose_ft_outline(m_cur_face->glyph->outline,
+                                 m_flip_y, 
+                                 m_affine,
+                                 m_path16);
+            m_rasterizer.add_path(m_curves16);
+        }
+        m_scanlines_aa.prepare(); // Remove all 
+        render_scanlines(m_rasterizer, m_scanline_aa, m_scanlines_aa);
+        m_bounds.x1 = m_scanlines_aa.min_x();
+        m_bounds.y1 = m_scanlines_aa.min_y();
+        m_bounds.x2 = m_scanlines_aa.max_x() + 1;
+        m_bounds.y2 = m_scanlines_aa.max_y() + 1;
+        m_data_size = m_scanlines_aa.byte_size(); 
+        m_data_type = glyph_data_gray8;
+        m_advance_x = int26p6_to_dbl(m_cur_face->glyph->advance.x);
+        m_advance_y = int26p6_to_dbl(m_cur_face->glyph->advance.y);
+        m_affine.transform(&m_advance_x, &m_advance_y);
+    }
+
+    //------------------------------------------------------------------------
+    // How far the outline reaches into the outermost pixel at a bounding box
+    // edge. Edges on the pixel grid cover the whole pixel
+    static double glyph_edge_ink(double edge, bool max_edge)
+    {
+        double ink = max_edge ? edge - floor(edge) : ceil(edge) - edge;
+        return ink == 0.0 ? 1.0 : ink;
+    }
+
+    //------------------------------------------------------------------------
+    bool font_engine_freetype_base::prepare_glyph_metrics(unsigned glyph_index)
+    {
+        if(m_glyph_rendering == glyph_ren_agg_gray8)
+        {
+            m_glyph_index = glyph_index;
+            m_last_error = FT_Load_Glyph(m_cur_face, 
+                                         m_glyph_index, 
+                                         m_hinting ? FT_LOAD_DEFAULT : FT_LOAD_NO_HINTING);
+            if(m_last_error != 0) return false;
+
+            FT_GlyphSlot slot = m_cur_face->glyph;
+            if(slot->format == FT_GLYPH_FORMAT_OUTLINE)
+            {
+                FT_BBox bbox;
+                FT_Outline_Get_BBox(&slot->outline, &bbox);
+                double x1 = int26p6_to_dbl(bbox.xMin);
+                double x2 = int26p6_to_dbl(bbox.xMax);
+                double y1 = m_flip_y ? -int26p6_to_dbl(bbox.yMax) : int26p6_to_dbl(bbox.yMin);
+                double y2 = m_flip_y ? -int26p6_to_dbl(bbox.yMin) : int26p6_to_dbl(bbox.yMax);
+                // The outermost pixels of the rasterized glyph are dropped if
+                // they end up with no coverage after gamma correction. The
+                // bounding box only gives the same bounds when the outline
+                // reaches far enough into these pixels and the glyph isn't
+                // tiny. Otherwise the glyph is rasterized below
+                const double min_ink = 0.375;
+                const double min_size = 3.0;
+                if(x2 - x1 >= min_size && y2 - y1 >= min_size &&
+                   glyph_edge_ink(x1, false) >= min_ink &&
+                   glyph_edge_ink(y1, false) >= min_ink &&
+                   glyph_edge_ink(x2, true) >= min_ink &&
+                   glyph_edge_ink(y2, true) >= min_ink)
+                {
+                    m_bounds.x1 = int(floor(x1));
+                    m_bounds.y1 = int(floor(y1));
+                    m_bounds.x2 = int(ceil(x2));
+                    m_bounds.y2 = int(ceil(y2));
+                    m_data_size = 0;
+                    m_data_type = glyph_data_gray8;
+                    m_advance_x = int26p6_to_dbl(slot->advance.x);
+                    m_advance_y = int26p6_to_dbl(slot->advance.y);
+                    return true;
+                }
+            }
+        }
+
+        // Rasterize the glyph without a transform to get its exact bounds,
+        // reusing the loaded glyph where possible
+        trans_affine mtx = m_affine;
+        m_affine.reset();
+        bool ok = true;
+        if(m_glyph_rendering == glyph_ren_agg_gray8)
+        {
+            rasterize_outline_gray8();
+        }
+        else
+        {
+            ok = prepare_glyph(glyph_index);
+        }
+        m_affine = mtx;
+        return ok;
+    }
+
     //------------------------------------------------------------------------
     void font_engine_freetype_base::write_glyph_to(int8u* data) const
     {
@@ -0,0 +1,106 @@
+#ifndef R_NO_REMAP
+#define R_NO_REMAP
+#endif
+
+#include <cstdlib>
+
+#include "../inst/include/ragg_api.h"
+#include <R_ext/GraphicsEngine.h>
+
+/* Thin .Call wrappers around the C API, used by the tests to reach the
+ * callables the same way other packages do, through the functions in
+ * inst/include/ragg_api.h. They are internal and unsupported, and are
+ * registered apart from the device entry points. Colours are given as
+ * character vectors and converted with RGBpar(). NULL colours are passed on as
+ * NULL pointers.
+ */
+
+static SEXP colour_ints(SEXP col) {
+  if (Rf_isNull(col)) {
+    return col;
+  }
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, Rf_length(col)));
+  for (int i = 0; i < Rf_length(col); ++i) {
+    INTEGER(out)[i] = RGBpar(col, i);
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+static const int* colour_ptr(SEXP col) {
+  return Rf_isNull(col) ? NULL : INTEGER(col);
+}
+
+static SEXP agg_internal_test_draw_text_c(SEXP str, SEXP x, SEXP y, SEXP col,
+                                          SEXP size) {
+  int n = Rf_length(str);
+  SEXP cols = PROTECT(colour_ints(col));
+  const char** strings = (const char**) R_alloc(n, sizeof(const char*));
+  for (int i = 0; i < n; ++i) {
+    SEXP s = STRING_ELT(str, i);
+    strings[i] = s == NA_STRING ? NULL : Rf_translateCharUTF8(s);
+  }
+  int res = ragg_draw_text(n, strings, REAL(x), REAL(y), NULL, NULL,
+                           INTEGER(cols), "", 1, REAL(size)[0]);
+  UNPROTECT(1);
+  return Rf_ScalarInteger(res);
+}
+
+static SEXP agg_internal_test_draw_points_c(SEXP x, SEXP y, SEXP r, SEXP fill,
+                                            SEXP col, SEXP lwd) {
+  SEXP fills = PROTECT(colour_ints(fill));
+  SEXP cols = PROTECT(colour_ints(col));
+  int res = ragg_draw_points(Rf_length(x), REAL(x), REAL(y), REAL(r),
+                             colour_ptr(fills), colour_ptr(cols), REAL(lwd)[0]);
+  UNPROTECT(2);
+  return Rf_ScalarInteger(res);
+}
+
+static SEXP agg_internal_test_draw_segments_c(SEXP x0, SEXP y0, SEXP x1,
+                                              SEXP y1, SEXP col, SEXP lwd,
+                                              SEXP lend) {
+  SEXP cols = PROTECT(colour_ints(col));
+  int res = ragg_draw_segments(Rf_length(x0), REAL(x0), REAL(y0), REAL(x1),
+                               REAL(y1), INTEGER(cols), REAL(lwd),
+                               INTEGER(lend)[0]);
+  UNPROTECT(1);
+  return Rf_ScalarInteger(res);
+}
+
+static SEXP agg_internal_test_draw_rects_c(SEXP x0, SEXP y0, SEXP x1, SEXP y1,
+                                           SEXP fill, SEXP col, SEXP lwd) {
+  SEXP fills = PROTECT(colour_ints(fill));
+  SEXP cols = PROTECT(colour_ints(col));
+  int res = ragg_draw_rects(Rf_length(x0), REAL(x0), REAL(y0), REAL(x1),
+                            REAL(y1), colour_ptr(fills), colour_ptr(cols),
+                            REAL(lwd)[0]);
+  UNPROTECT(2);
+  return Rf_ScalarInteger(res);
+}
+
+/* Opens a buffer device rendering into a new raw vector of height rows of
+ * stride bytes, which is returned. The caller must keep the vector alive
+ * until the device is closed. Returns NULL if the device couldn't be opened
+ */
+static SEXP agg_internal_test_device_buffer_c(SEXP width, SEXP height,
+                                              SEXP stride, SEXP format,
+                                              SEXP bg) {
+  int h = INTEGER(height)[0];
+  int s = INTEGER(stride)[0];
+  SEXP buffer = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t) std::abs(s) * (h < 0 ? 0 : h)));
+  int res = ragg_device_buffer(RAW(buffer), INTEGER(width)[0], h, s,
+                               INTEGER(format)[0], 12, RGBpar(bg, 0), 72, 1,
+                               1, NULL);
+  UNPROTECT(1);
+  return res == 0 ? buffer : R_NilValue;
+}
+
+// Registered by R_init_ragg() after the device entry points
+extern const R_CallMethodDef TestCallEntries[] = {
+  {"agg_internal_test_draw_text_c", (DL_FUNC) &agg_internal_test_draw_text_c, 5},
+  {"agg_internal_test_draw_points_c", (DL_FUNC) &agg_internal_test_draw_points_c, 6},
+  {"agg_internal_test_draw_segments_c", (DL_FUNC) &agg_internal_test_draw_segments_c, 7},
+  {"agg_internal_test_draw_rects_c", (DL_FUNC) &agg_internal_test_draw_rects_c, 7},
+  {"agg_internal_test_device_buffer_c", (DL_FUNC) &agg_internal_test_device_buffer_c, 5},
+  {NULL, NULL, 0}
+};
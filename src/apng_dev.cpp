@@ -0,0 +1,48 @@
+#include "ragg.h"
+#include "init_device.h"
+#include "AggDeviceApng.h"
+
+// [[export]]
+SEXP agg_apng_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+                SEXP res, SEXP scaling, SEXP snap, SEXP compression,
+                SEXP palette, SEXP delay, SEXP loop) {
+  int bgCol = RGBpar(bg, 0);
+
+  BEGIN_CPP
+  if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
+    AggDeviceApngNoAlpha* device = new AggDeviceApngNoAlpha(
+      Rf_translateCharUTF8((STRING_ELT(file, 0))),
+      INTEGER(width)[0],
+      INTEGER(height)[0],
+      REAL(pointsize)[0],
+      bgCol,
+      REAL(res)[0],
+      REAL(scaling)[0],
+      LOGICAL(snap)[0],
+      INTEGER(compression)[0],
+      LOGICAL(palette)[0],
+      INTEGER(delay)[0],
+      INTEGER(loop)[0]
+    );
+    makeDevice<AggDeviceApngNoAlpha>(device, "agg_apng");
+  } else {
+    AggDeviceApngAlpha* device = new AggDeviceApngAlpha(
+      Rf_translateCharUTF8((STRING_ELT(file, 0))),
+      INTEGER(width)[0],
+      INTEGER(height)[0],
+      REAL(pointsize)[0],
+      bgCol,
+      REAL(res)[0],
+      REAL(scaling)[0],
+      LOGICAL(snap)[0],
+      INTEGER(compression)[0],
+      LOGICAL(palette)[0],
+      INTEGER(delay)[0],
+      INTEGER(loop)[0]
+    );
+    makeDevice<AggDeviceApngAlpha>(device, "agg_apng");
+  }
+  END_CPP
+
+  return R_NilValue;
+}
@@ -0,0 +1,57 @@
+#include "ragg.h"
+#include "init_device.h"
+
+#include "AggDeviceBuffer.h"
+
+#include <cstdlib>
+
+template<class T>
+static void make_buffer_device(unsigned char* data, int stride, int width,
+                               int height, double pointsize, int bg,
+                               double res, double scaling, bool snap,
+                               const char* name) {
+  T* device = new T(data, stride, width, height, pointsize, bg, res, scaling,
+                    snap);
+  makeDevice<T>(device, name);
+}
+
+// Registered as a C-callable, see inst/include/ragg_api.h
+int ragg_device_buffer(unsigned char* data, int width, int height, int stride,
+                       int format, double pointsize, int bg, double res,
+                       double scaling, int snap, const char* name) {
+  int bytes_per_pixel;
+  switch (format) {
+  case BUFFER_RGBA:
+  case BUFFER_BGRA:
+    bytes_per_pixel = 4;
+    break;
+  case BUFFER_RGB:
+    bytes_per_pixel = 3;
+    break;
+  default:
+    return 1;
+  }
+  if (data == NULL || width <= 0 || height <= 0 ||
+      std::abs(stride) < width * bytes_per_pixel) {
+    return 1;
+  }
+  if (name == NULL) {
+    name = "agg_buffer";
+  }
+
+  BEGIN_CPP
+  switch (format) {
+  case BUFFER_RGBA:
+    make_buffer_device<AggDeviceBufferRGBA>(data, stride, width, height, pointsize, bg, res, scaling, snap, name);
+    break;
+  case BUFFER_BGRA:
+    make_buffer_device<AggDeviceBufferBGRA>(data, stride, width, height, pointsize, bg, res, scaling, snap, name);
+    break;
+  case BUFFER_RGB:
+    make_buffer_device<AggDeviceBufferRGB>(data, stride, width, height, pointsize, bg, res, scaling, snap, name);
+    break;
+  }
+  END_CPP
+
+  return 0;
+}
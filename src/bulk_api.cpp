@@ -0,0 +1,86 @@
+#include "bulk_api.h"
+
+#include <memory>
+#include <unordered_map>
+
+static std::unordered_map<pDevDesc, std::unique_ptr<BulkTarget>>& bulk_targets() {
+  static std::unordered_map<pDevDesc, std::unique_ptr<BulkTarget>> targets;
+  return targets;
+}
+
+void register_bulk_target(pDevDesc dd, BulkTarget* target) {
+  bulk_targets()[dd].reset(target);
+}
+
+void unregister_bulk_target(pDevDesc dd) {
+  bulk_targets().erase(dd);
+}
+
+// The target of the current device or NULL if it is not a ragg device
+static BulkTarget* current_bulk_target() {
+  if (Rf_NoDevices()) {
+    return NULL;
+  }
+  pGEDevDesc gd = GEcurrentDevice();
+  auto it = bulk_targets().find(gd->dev);
+  return it == bulk_targets().end() ? NULL : it->second.get();
+}
+
+int ragg_draw_text(int n, const char **str, const double *x, const double *y,
+                   const double *rot, const double *hadj, const int *col,
+                   const char *family, int face, double size) {
+  BulkTarget* target = current_bulk_target();
+  if (target == NULL) {
+    return 1;
+  }
+
+  BEGIN_CPP
+  target->draw_text(n, str, x, y, rot, hadj, col, family, face, size);
+  END_CPP
+
+  return 0;
+}
+
+int ragg_draw_points(int n, const double *x, const double *y, const double *r,
+                     const int *fill, const int *col, double lwd) {
+  BulkTarget* target = current_bulk_target();
+  if (target == NULL) {
+    return 1;
+  }
+
+  BEGIN_CPP
+  target->draw_points(n, x, y, r, fill, col, lwd);
+  END_CPP
+
+  return 0;
+}
+
+int ragg_draw_segments(int n, const double *x0, const double *y0,
+                       const double *x1, const double *y1, const int *col,
+                       const double *lwd, int lend) {
+  BulkTarget* target = current_bulk_target();
+  if (target == NULL) {
+    return 1;
+  }
+
+  BEGIN_CPP
+  target->draw_segments(n, x0, y0, x1, y1, col, lwd, lend);
+  END_CPP
+
+  return 0;
+}
+
+int ragg_draw_rects(int n, const double *x0, const double *y0,
+                    const double *x1, const double *y1, const int *fill,
+                    const int *col, double lwd) {
+  BulkTarget* target = current_bulk_target();
+  if (target == NULL) {
+    return 1;
+  }
+
+  BEGIN_CPP
+  target->draw_rects(n, x0, y0, x1, y1, fill, col, lwd);
+  END_CPP
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "ragg.h"
+
+/* The bulk drawing API lets compiled code in other packages draw many elements
+ * on the current ragg device with a single call, bypassing the per-element
+ * device callbacks of the graphics engine. The functions are registered as
+ * C-callables in R_init_ragg() and declared for other packages in
+ * inst/include/ragg_api.h.
+ *
+ * As the device type is a template parameter, each device registers a
+ * BulkTarget wrapping it when it is created, keyed by its device description.
+ * The callables look up the target of the current device and fail if it isn't
+ * a ragg device
+ */
+class BulkTarget {
+public:
+  virtual ~BulkTarget() {}
+  virtual void draw_text(int n, const char **str, const double *x,
+                         const double *y, const double *rot,
+                         const double *hadj, const int *col,
+                         const char *family, int face, double size) = 0;
+  virtual void draw_points(int n, const double *x, const double *y,
+                           const double *r, const int *fill, const int *col,
+                           double lwd) = 0;
+  virtual void draw_segments(int n, const double *x0, const double *y0,
+                             const double *x1, const double *y1,
+                             const int *col, const double *lwd, int lend) = 0;
+  virtual void draw_rects(int n, const double *x0, const double *y0,
+                          const double *x1, const double *y1, const int *fill,
+                          const int *col, double lwd) = 0;
+};
+
+template<class T>
+class BulkTargetDevice : public BulkTarget {
+  T* device;
+
+public:
+  BulkTargetDevice(T* dev) : device(dev) {}
+
+  void draw_text(int n, const char **str, const double *x, const double *y,
+                 const double *rot, const double *hadj, const int *col,
+                 const char *family, int face, double size) {
+    device->drawTextBulk(n, str, x, y, rot, hadj, col, family, face, size);
+  }
+  void draw_points(int n, const double *x, const double *y, const double *r,
+                   const int *fill, const int *col, double lwd) {
+    device->drawCirclesBulk(n, x, y, r, fill, col, lwd);
+  }
+  void draw_segments(int n, const double *x0, const double *y0,
+                     const double *x1, const double *y1, const int *col,
+                     const double *lwd, int lend) {
+    device->drawSegmentsBulk(n, x0, y0, x1, y1, col, lwd, (R_GE_lineend) lend);
+  }
+  void draw_rects(int n, const double *x0, const double *y0, const double *x1,
+                  const double *y1, const int *fill, const int *col,
+                  double lwd) {
+    device->drawRectsBulk(n, x0, y0, x1, y1, fill, col, lwd);
+  }
+};
+
+void register_bulk_target(pDevDesc dd, BulkTarget* target);
+void unregister_bulk_target(pDevDesc dd);
+
+extern "C" {
+int ragg_draw_text(int n, const char **str, const double *x, const double *y,
+                   const double *rot, const double *hadj, const int *col,
+                   const char *family, int face, double size);
+int ragg_draw_points(int n, const double *x, const double *y, const double *r,
+                     const int *fill, const int *col, double lwd);
+int ragg_draw_segments(int n, const double *x0, const double *y0,
+                       const double *x1, const double *y1, const int *col,
+                       const double *lwd, int lend);
+int ragg_draw_rects(int n, const double *x0, const double *y0,
+                    const double *x1, const double *y1, const int *fill,
+                    const int *col, double lwd);
+}
@@ -0,0 +1,36 @@
+#include "ragg.h"
+#include "glyph_atlas.h"
+#include "disk_cache.h"
+
+// [[export]]
+SEXP agg_glyph_cache_info_c() {
+  GlyphAtlas& atlas = get_glyph_atlas();
+
+  SEXP info = PROTECT(Rf_allocVector(REALSXP, 6));
+  REAL(info)[0] = atlas.budget();
+  REAL(info)[1] = atlas.size();
+  REAL(info)[2] = atlas.n_glyphs();
+  REAL(info)[3] = atlas.hits;
+  REAL(info)[4] = atlas.misses;
+  REAL(info)[5] = atlas.evictions;
+
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 6));
+  SET_STRING_ELT(names, 0, Rf_mkChar("budget"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("size"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("glyphs"));
+  SET_STRING_ELT(names, 3, Rf_mkChar("hits"));
+  SET_STRING_ELT(names, 4, Rf_mkChar("misses"));
+  SET_STRING_ELT(names, 5, Rf_mkChar("evictions"));
+  Rf_setAttrib(info, R_NamesSymbol, names);
+
+  UNPROTECT(2);
+  return info;
+}
+
+// [[export]]
+SEXP agg_flush_cache_c() {
+  if (!get_disk_cache().save(true)) {
+    Rf_warning("agg could not write to the font cache file: %s", get_disk_cache().path().c_str());
+  }
+  return R_NilValue;
+}
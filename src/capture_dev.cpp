@@ -23,3 +23,55 @@ SEXP agg_capture_c(SEXP name, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
   
   return R_NilValue;
 }
+
+// Convert a captured raster the way dev.capture() does, i.e. to a nativeRaster
+// or a matrix of colour names
+static SEXP finish_capture(SEXP raster, bool native) {
+  if (Rf_isNull(raster)) {
+    return raster;
+  }
+  if (native) {
+    Rf_setAttrib(raster, R_ClassSymbol, Rf_mkString("nativeRaster"));
+    return raster;
+  }
+  SEXP dims = Rf_getAttrib(raster, R_DimSymbol);
+  int nrow = INTEGER(dims)[0];
+  int ncol = INTEGER(dims)[1];
+  int* pixels = INTEGER(raster);
+  SEXP image = PROTECT(Rf_allocVector(STRSXP, (R_xlen_t) nrow * ncol));
+  for (int row = 0; row < nrow; ++row) {
+    for (int col = 0; col < ncol; ++col) {
+      SET_STRING_ELT(image, (R_xlen_t) col * nrow + row,
+                     Rf_mkChar(col2name(pixels[row * ncol + col])));
+    }
+  }
+  Rf_setAttrib(image, R_DimSymbol, dims);
+  Rf_setAttrib(image, Rf_install("offset"), Rf_getAttrib(raster, Rf_install("offset")));
+  Rf_setAttrib(image, Rf_install("page"), Rf_getAttrib(raster, Rf_install("page")));
+  UNPROTECT(1);
+  return image;
+}
+
+// [[export]]
+SEXP agg_capture_region_c(SEXP region, SEXP changes, SEXP native) {
+  pDevDesc dd = GEcurrentDevice()->dev;
+  if (dd->cap != agg_capture<AggDeviceCaptureAlpha>) {
+    Rf_error("The current device is not an agg_capture() device");
+  }
+  AggDeviceCaptureAlpha* device = (AggDeviceCaptureAlpha*) dd->deviceSpecific;
+  SEXP raster = R_NilValue;
+
+  BEGIN_CPP
+  if (LOGICAL(changes)[0]) {
+    raster = device->capture_changes();
+  } else {
+    int* reg = INTEGER(region);
+    raster = device->capture_region(reg[0], reg[1], reg[2], reg[3]);
+  }
+  END_CPP
+
+  PROTECT(raster);
+  raster = finish_capture(raster, LOGICAL(native)[0]);
+  UNPROTECT(1);
+  return raster;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+
+#include "agg_basics.h"
+#include "agg_renderer_base.h"
+
+/* The damaged region of a buffer as the bounding box of everything drawn since
+ * it was last reset. x2 and y2 are exclusive
+ */
+struct DamageRect {
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+
+  DamageRect() {
+    reset();
+  }
+
+  void reset() {
+    x1 = y1 = 0;
+    x2 = y2 = 0;
+  }
+  bool empty() const {
+    return x2 <= x1 || y2 <= y1;
+  }
+  void add(int l, int t, int r, int b) {
+    if (r <= l || b <= t) {
+      return;
+    }
+    if (empty()) {
+      x1 = l; y1 = t; x2 = r; y2 = b;
+      return;
+    }
+    x1 = std::min(x1, l);
+    y1 = std::min(y1, t);
+    x2 = std::max(x2, r);
+    y2 = std::max(y2, b);
+  }
+};
+
+/* A renderer that records the region it has drawn to. All drawing on a device
+ * goes through its base renderer, so this catches everything without the
+ * drawing methods having to report their extent. The recorded region may be
+ * larger than what was actually changed, e.g. for spans with zero coverage
+ */
+template<class PixFmt>
+class DamageRenderer : public agg::renderer_base<PixFmt> {
+  typedef agg::renderer_base<PixFmt> base_type;
+
+  DamageRect m_damage;
+
+public:
+  typedef typename base_type::color_type color_type;
+  typedef agg::cover_type cover_type;
+
+  DamageRenderer() : base_type() {}
+  explicit DamageRenderer(PixFmt& ren) : base_type(ren) {}
+
+  DamageRect& damage() {
+    return m_damage;
+  }
+
+  void clear(const color_type& c) {
+    mark(0, 0, this->width(), this->height());
+    base_type::clear(c);
+  }
+  void fill(const color_type& c) {
+    mark(0, 0, this->width(), this->height());
+    base_type::fill(c);
+  }
+  void copy_pixel(int x, int y, const color_type& c) {
+    mark(x, y, x + 1, y + 1);
+    base_type::copy_pixel(x, y, c);
+  }
+  void blend_pixel(int x, int y, const color_type& c, cover_type cover) {
+    mark(x, y, x + 1, y + 1);
+    base_type::blend_pixel(x, y, c, cover);
+  }
+  void copy_hline(int x1, int y, int x2, const color_type& c) {
+    mark(std::min(x1, x2), y, std::max(x1, x2) + 1, y + 1);
+    base_type::copy_hline(x1, y, x2, c);
+  }
+  void copy_vline(int x, int y1, int y2, const color_type& c) {
+    mark(x, std::min(y1, y2), x + 1, std::max(y1, y2) + 1);
+    base_type::copy_vline(x, y1, y2, c);
+  }
+  void blend_hline(int x1, int y, int x2, const color_type& c,
+                   cover_type cover) {
+    mark(std::min(x1, x2), y, std::max(x1, x2) + 1, y + 1);
+    base_type::blend_hline(x1, y, x2, c, cover);
+  }
+  void blend_vline(int x, int y1, int y2, const color_type& c,
+                   cover_type cover) {
+    mark(x, std::min(y1, y2), x + 1, std::max(y1, y2) + 1);
+    base_type::blend_vline(x, y1, y2, c, cover);
+  }
+  void copy_bar(int x1, int y1, int x2, int y2, const color_type& c) {
+    mark(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1,
+         std::max(y1, y2) + 1);
+    base_type::copy_bar(x1, y1, x2, y2, c);
+  }
+  void blend_bar(int x1, int y1, int x2, int y2, const color_type& c,
+                 cover_type cover) {
+    mark(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1,
+         std::max(y1, y2) + 1);
+    base_type::blend_bar(x1, y1, x2, y2, c, cover);
+  }
+  void blend_solid_hspan(int x, int y, int len, const color_type& c,
+                         const cover_type* covers) {
+    mark(x, y, x + len, y + 1);
+    base_type::blend_solid_hspan(x, y, len, c, covers);
+  }
+  void blend_solid_vspan(int x, int y, int len, const color_type& c,
+                         const cover_type* covers) {
+    mark(x, y, x + 1, y + len);
+    base_type::blend_solid_vspan(x, y, len, c, covers);
+  }
+  void copy_color_hspan(int x, int y, int len, const color_type* colors) {
+    mark(x, y, x + len, y + 1);
+    base_type::copy_color_hspan(x, y, len, colors);
+  }
+  void copy_color_vspan(int x, int y, int len, const color_type* colors) {
+    mark(x, y, x + 1, y + len);
+    base_type::copy_color_vspan(x, y, len, colors);
+  }
+  void blend_color_hspan(int x, int y, int len, const color_type* colors,
+                         const cover_type* covers,
+                         cover_type cover = agg::cover_full) {
+    mark(x, y, x + len, y + 1);
+    base_type::blend_color_hspan(x, y, len, colors, covers, cover);
+  }
+  void blend_color_vspan(int x, int y, int len, const color_type* colors,
+                         const cover_type* covers,
+                         cover_type cover = agg::cover_full) {
+    mark(x, y, x + 1, y + len);
+    base_type::blend_color_vspan(x, y, len, colors, covers, cover);
+  }
+
+  template<class RenBuf>
+  void copy_from(const RenBuf& src, const agg::rect_i* rect_src_ptr = 0,
+                 int dx = 0, int dy = 0) {
+    add_area(src.width(), src.height(), rect_src_ptr, dx, dy);
+    base_type::copy_from(src, rect_src_ptr, dx, dy);
+  }
+  template<class SrcPixelFormatRenderer>
+  void blend_from(const SrcPixelFormatRenderer& src,
+                  const agg::rect_i* rect_src_ptr = 0, int dx = 0, int dy = 0,
+                  cover_type cover = agg::cover_full) {
+    add_area(src.width(), src.height(), rect_src_ptr, dx, dy);
+    base_type::blend_from(src, rect_src_ptr, dx, dy, cover);
+  }
+  template<class SrcPixelFormatRenderer>
+  void blend_from_color(const SrcPixelFormatRenderer& src,
+                        const color_type& color,
+                        const agg::rect_i* rect_src_ptr = 0, int dx = 0,
+                        int dy = 0, cover_type cover = agg::cover_full) {
+    add_area(src.width(), src.height(), rect_src_ptr, dx, dy);
+    base_type::blend_from_color(src, color, rect_src_ptr, dx, dy, cover);
+  }
+  template<class SrcPixelFormatRenderer>
+  void blend_from_lut(const SrcPixelFormatRenderer& src,
+                      const color_type* color_lut,
+                      const agg::rect_i* rect_src_ptr = 0, int dx = 0,
+                      int dy = 0, cover_type cover = agg::cover_full) {
+    add_area(src.width(), src.height(), rect_src_ptr, dx, dy);
+    base_type::blend_from_lut(src, color_lut, rect_src_ptr, dx, dy, cover);
+  }
+
+private:
+  // Record an area, limited to the clip box as nothing is drawn outside of it
+  void mark(int l, int t, int r, int b) {
+    m_damage.add(std::max(l, this->xmin()), std::max(t, this->ymin()),
+                 std::min(r, this->xmax() + 1), std::min(b, this->ymax() + 1));
+  }
+  void add_area(int w, int h, const agg::rect_i* rect_src_ptr, int dx,
+                int dy) {
+    if (rect_src_ptr) {
+      mark(rect_src_ptr->x1 + dx, rect_src_ptr->y1 + dy,
+           rect_src_ptr->x2 + 1 + dx, rect_src_ptr->y2 + 1 + dy);
+    } else {
+      mark(dx, dy, w + dx, h + dy);
+    }
+  }
+};
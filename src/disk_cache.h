@@ -0,0 +1,586 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <systemfonts.h>
+
+#include "glyph_atlas.h"
+#include "metric_cache.h"
+
+// Version of the cache file format. Must be increased whenever the layout of
+// the file, or the way glyphs are rendered or measured, changes
+static const uint32_t DISK_CACHE_VERSION = 3;
+// Maximum amount of rendered glyph data written to the cache file (8Mb)
+static const size_t DISK_CACHE_GLYPH_BUDGET = 1 << 23;
+// Number of entries that must have been added to the caches before they are
+// written when a device is closed. Smaller changes are written on exit
+static const size_t DISK_CACHE_SAVE_CHANGES = 1024;
+
+/* A read-only view of a file. The file is memory mapped where possible and
+ * otherwise read into memory
+ */
+class MappedFile {
+  const unsigned char* m_data;
+  size_t m_size;
+#if defined(_WIN32)
+  std::vector<unsigned char> m_buffer;
+#endif
+
+public:
+  MappedFile(const std::string& path) : m_data(NULL), m_size(0) {
+#if defined(_WIN32)
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+      return;
+    }
+    if (fseek(f, 0, SEEK_END) == 0) {
+      long size = ftell(f);
+      if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        m_buffer.resize(size);
+        if (fread(m_buffer.data(), 1, size, f) == size_t(size)) {
+          m_data = m_buffer.data();
+          m_size = size;
+        }
+      }
+    }
+    fclose(f);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        m_data = (const unsigned char*) data;
+        m_size = info.st_size;
+      }
+    }
+    ::close(fd);
+#endif
+  }
+  ~MappedFile() {
+#if !defined(_WIN32)
+    if (m_data != NULL) {
+      munmap((void*) m_data, m_size);
+    }
+#endif
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const unsigned char* data() const {
+    return m_data;
+  }
+  size_t size() const {
+    return m_size;
+  }
+};
+
+class CacheWriter {
+public:
+  std::vector<unsigned char> buffer;
+
+  template<typename T>
+  void put(const T& value) {
+    const unsigned char* p = (const unsigned char*) &value;
+    buffer.insert(buffer.end(), p, p + sizeof(T));
+  }
+  void put_bytes(const unsigned char* data, size_t size) {
+    buffer.insert(buffer.end(), data, data + size);
+  }
+  void put_string(const std::string& string) {
+    put<uint32_t>(string.size());
+    put_bytes((const unsigned char*) string.data(), string.size());
+  }
+};
+
+// Reads back what CacheWriter wrote. Reading past the end sets good() to false
+// and returns zeroed values
+class CacheReader {
+  const unsigned char* m_cur;
+  const unsigned char* m_end;
+  bool m_good;
+
+public:
+  CacheReader(const unsigned char* data, size_t size) :
+    m_cur(data), m_end(data + size), m_good(true) {}
+
+  bool good() const {
+    return m_good;
+  }
+
+  template<typename T>
+  T get() {
+    T value = T();
+    const unsigned char* data = get_bytes(sizeof(T));
+    if (data != NULL) {
+      memcpy(&value, data, sizeof(T));
+    }
+    return value;
+  }
+  const unsigned char* get_bytes(size_t size) {
+    if (!m_good || size_t(m_end - m_cur) < size) {
+      m_good = false;
+      return NULL;
+    }
+    const unsigned char* data = m_cur;
+    m_cur += size;
+    return data;
+  }
+  std::string get_string() {
+    uint32_t size = get<uint32_t>();
+    const unsigned char* data = get_bytes(size);
+    return data == NULL ? std::string() : std::string((const char*) data, size);
+  }
+};
+
+/* The file starts with a fixed header. Files written by another version of
+ * ragg or FreeType, or on a machine with a different byte order, are ignored
+ * as is a file that doesn't match its checksum (e.g. because it is truncated)
+ */
+struct DiskCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t freetype;
+  uint32_t subpixel_bins;
+  uint64_t size;
+  uint64_t checksum;
+};
+
+/* The disk cache persists the process-wide caches between R sessions so that
+ * short-lived sessions don't need to measure strings and rasterize glyphs from
+ * scratch. It holds the fallback font, string width, character and glyph metric
+ * caches, and the most recently used glyphs of the glyph atlas. The resolution
+ * of font families to files is not stored, as it depends on the fonts
+ * registered with systemfonts in the current session.
+ *
+ * Everything is stored relative to a table of the font files it came from,
+ * along with their modification time and size. Entries from a font file that
+ * has since changed (or been removed) are dropped when the file is read. The
+ * file is read when the cache is opened. It is written when a device is closed
+ * if a substantial number of entries has been added since it was last written,
+ * and otherwise when R exits or ragg is unloaded. It is written to a temporary
+ * file first which is then moved into place, so concurrent sessions sharing a
+ * cache file never see a partially written file
+ */
+class DiskCache {
+  std::string m_path;
+  size_t m_stamp;
+  // Whether the file is missing or invalid and should be written even if
+  // nothing has been added to the caches
+  bool m_rewrite;
+
+public:
+  DiskCache() : m_stamp(0), m_rewrite(false) {}
+
+  bool enabled() const {
+    return !m_path.empty();
+  }
+  const std::string& path() const {
+    return m_path;
+  }
+
+  // Use the cache file at path, reading it if it exists. An empty path
+  // disables the disk cache. Changes not yet written to the previous file are
+  // written first
+  void open(const std::string& path) {
+    if (path == m_path) {
+      return;
+    }
+    save(true);
+    m_path = path;
+    bool valid = enabled() && read();
+    m_rewrite = enabled() && !valid;
+    m_stamp = stamp();
+  }
+
+  // Write the caches to the cache file if they have changed since it was
+  // opened or last written. Unless force is true, this is only done once a
+  // substantial number of entries has been added. Returns false if the file
+  // couldn't be written
+  bool save(bool force = false) {
+    if (!enabled()) {
+      return true;
+    }
+    size_t changes = stamp() - m_stamp;
+    if (changes == 0 && !m_rewrite) {
+      return true;
+    }
+    if (!force && changes < DISK_CACHE_SAVE_CHANGES) {
+      return true;
+    }
+
+    std::vector<unsigned char> payload = serialize();
+
+    DiskCacheHeader header;
+    init_header(header);
+    header.size = payload.size();
+    header.checksum = checksum(payload.data(), payload.size());
+
+    std::string tmp = m_path + ".tmp" + std::to_string(process_id());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+      return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(payload.data(), 1, payload.size(), f) == payload.size();
+    ok = fclose(f) == 0 && ok;
+    if (ok) {
+#if defined(_WIN32)
+      // rename() doesn't replace existing files on Windows
+      remove(m_path.c_str());
+#endif
+      ok = rename(tmp.c_str(), m_path.c_str()) == 0;
+    }
+    if (!ok) {
+      remove(tmp.c_str());
+      return false;
+    }
+    m_stamp = stamp();
+    m_rewrite = false;
+    return true;
+  }
+
+private:
+  // Changes whenever something is added to the caches
+  size_t stamp() const {
+    MetricCache& metrics = get_metric_cache();
+    return get_glyph_atlas().misses + metrics.chars.added() +
+      metrics.strings.added() + metrics.fallbacks.added() +
+      metrics.glyphs.added();
+  }
+
+  static int process_id() {
+#if defined(_WIN32)
+    return _getpid();
+#else
+    return getpid();
+#endif
+  }
+
+  static void init_header(DiskCacheHeader& header) {
+    memcpy(header.magic, "RAGGFONT", 8);
+    header.version = DISK_CACHE_VERSION;
+    header.byte_order = 0x01020304;
+    header.freetype = FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH;
+    header.subpixel_bins = GLYPH_SUBPIXEL_BINS;
+    header.size = 0;
+    header.checksum = 0;
+  }
+
+  static uint64_t checksum(const unsigned char* data, size_t size) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; ++i) {
+      h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  static bool file_info(const std::string& file, int64_t& mtime, int64_t& size) {
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0) {
+      return false;
+    }
+    mtime = info.st_mtime;
+    size = info.st_size;
+    return true;
+  }
+
+  static FontSettings font_settings(const std::string& file, unsigned int index) {
+    FontSettings font;
+    memset(&font, 0, sizeof(FontSettings));
+    strncpy(font.file, file.c_str(), PATH_MAX);
+    font.index = index;
+    font.features = NULL;
+    font.n_features = 0;
+    return font;
+  }
+
+  /* The payload consists of the face table followed by the fallbacks,
+   * character metrics, string widths, glyph metrics, and glyphs. Each section
+   * starts with its number of entries and refers to faces by their position in
+   * the face table
+   */
+  std::vector<unsigned char> serialize() {
+    GlyphAtlas& atlas = get_glyph_atlas();
+    MetricCache& metrics = get_metric_cache();
+
+    CacheWriter faces;
+    uint32_t n_faces = 0;
+    std::unordered_map<unsigned int, uint32_t> face_refs;
+    const uint32_t no_face = UINT32_MAX;
+    auto face_ref = [&](unsigned int id) {
+      auto it = face_refs.find(id);
+      if (it != face_refs.end()) {
+        return it->second;
+      }
+      std::string file;
+      unsigned int index;
+      int64_t mtime, size;
+      uint32_t ref = no_face;
+      if (atlas.face_file(id, file, index) && file_info(file, mtime, size)) {
+        faces.put_string(file);
+        faces.put<uint32_t>(index);
+        faces.put<int64_t>(mtime);
+        faces.put<int64_t>(size);
+        ref = n_faces++;
+      }
+      face_refs[id] = ref;
+      return ref;
+    };
+    auto font_ref = [&](const FontSettings& font) {
+      if (font.n_features != 0) {
+        return no_face;
+      }
+      return face_ref(atlas.face_id(font.file, font.index));
+    };
+
+    CacheWriter body;
+    CacheWriter section;
+    uint32_t n;
+
+    n = 0;
+    metrics.fallbacks.each([&](const FallbackKey& key, const FontSettings& font) {
+      uint32_t ref = face_ref(key.face);
+      uint32_t fallback_ref = font_ref(font);
+      if (ref == no_face || fallback_ref == no_face) return;
+      section.put<uint32_t>(ref);
+      section.put<int32_t>(key.c);
+      section.put<uint32_t>(fallback_ref);
+      n++;
+    });
+    body.put<uint32_t>(n);
+    body.put_bytes(section.buffer.data(), section.buffer.size());
+    section.buffer.clear();
+
+    n = 0;
+    metrics.chars.each([&](const CharMetricKey& key, const CharMetric& metric) {
+      uint32_t ref = face_ref(key.face);
+      if (ref == no_face) return;
+      section.put<uint32_t>(ref);
+      section.put_string(key.features);
+      section.put<double>(key.size);
+      section.put<int32_t>(key.c);
+      section.put<double>(metric.ascent);
+      section.put<double>(metric.descent);
+      section.put<double>(metric.width);
+      n++;
+    });
+    body.put<uint32_t>(n);
+    body.put_bytes(section.buffer.data(), section.buffer.size());
+    section.buffer.clear();
+
+    n = 0;
+    metrics.strings.each([&](const StringWidthKey& key, double width) {
+      uint32_t ref = face_ref(key.face);
+      if (ref == no_face) return;
+      section.put<uint32_t>(ref);
+      section.put_string(key.features);
+      section.put<double>(key.size);
+      section.put_string(key.string);
+      section.put<double>(width);
+      n++;
+    });
+    body.put<uint32_t>(n);
+    body.put_bytes(section.buffer.data(), section.buffer.size());
+    section.buffer.clear();
+
+    n = 0;
+    metrics.glyphs.each([&](const GlyphKey& key, const GlyphMetrics& metric) {
+      GlyphKey disk_key = key;
+      disk_key.face = face_ref(key.face);
+      if (disk_key.face == no_face) return;
+      section.put<GlyphKey>(disk_key);
+      section.put<agg::rect_i>(metric.bounds);
+      section.put<double>(metric.advance_x);
+      section.put<double>(metric.advance_y);
+      section.put<uint8_t>(metric.colour);
+      n++;
+    });
+    body.put<uint32_t>(n);
+    body.put_bytes(section.buffer.data(), section.buffer.size());
+    section.buffer.clear();
+
+    n = 0;
+    size_t glyph_bytes = 0;
+    atlas.each([&](const GlyphKey& key, const agg::glyph_cache& glyph) {
+      if (glyph.data_type == agg::glyph_data_invalid ||
+          glyph_bytes + glyph.data_size > DISK_CACHE_GLYPH_BUDGET) return;
+      GlyphKey disk_key = key;
+      disk_key.face = face_ref(key.face);
+      if (disk_key.face == no_face) return;
+      section.put<GlyphKey>(disk_key);
+      section.put<int32_t>(glyph.data_type);
+      section.put<agg::rect_i>(glyph.bounds);
+      section.put<double>(glyph.advance_x);
+      section.put<double>(glyph.advance_y);
+      section.put<uint32_t>(glyph.data_size);
+      section.put_bytes(glyph.data, glyph.data_size);
+      glyph_bytes += glyph.data_size;
+      n++;
+    });
+    body.put<uint32_t>(n);
+    body.put_bytes(section.buffer.data(), section.buffer.size());
+
+    CacheWriter payload;
+    payload.put<uint32_t>(n_faces);
+    payload.put_bytes(faces.buffer.data(), faces.buffer.size());
+    payload.put_bytes(body.buffer.data(), body.buffer.size());
+    return std::move(payload.buffer);
+  }
+
+  // Read the cache file into the process-wide caches. A missing, outdated, or
+  // corrupt file is ignored and false is returned
+  bool read() {
+    MappedFile file(m_path);
+    DiskCacheHeader header;
+    DiskCacheHeader expected;
+    init_header(expected);
+    if (file.size() < sizeof(header)) {
+      return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    const unsigned char* data = file.data() + sizeof(header);
+    if (memcmp(header.magic, expected.magic, 8) != 0 ||
+        header.version != expected.version ||
+        header.byte_order != expected.byte_order ||
+        header.freetype != expected.freetype ||
+        header.subpixel_bins != expected.subpixel_bins ||
+        header.size != file.size() - sizeof(header) ||
+        header.checksum != checksum(data, header.size)) {
+      return false;
+    }
+
+    GlyphAtlas& atlas = get_glyph_atlas();
+    MetricCache& metrics = get_metric_cache();
+    CacheReader reader(data, header.size);
+
+    // Faces whose file has changed since the cache was written are invalid
+    uint32_t n = reader.get<uint32_t>();
+    std::vector<std::string> face_files;
+    std::vector<unsigned int> face_indices;
+    std::vector<bool> face_valid;
+    std::vector<unsigned int> face_ids;
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      std::string path = reader.get_string();
+      unsigned int index = reader.get<uint32_t>();
+      int64_t mtime = reader.get<int64_t>();
+      int64_t size = reader.get<int64_t>();
+      int64_t cur_mtime, cur_size;
+      bool valid = reader.good() && file_info(path, cur_mtime, cur_size) &&
+        mtime == cur_mtime && size == cur_size;
+      face_files.push_back(path);
+      face_indices.push_back(index);
+      face_valid.push_back(valid);
+      face_ids.push_back(valid ? atlas.face_id(path.c_str(), index) : 0);
+    }
+    auto face = [&](uint32_t ref, unsigned int& id) {
+      if (!reader.good() || ref >= face_valid.size() || !face_valid[ref]) {
+        return false;
+      }
+      id = face_ids[ref];
+      return true;
+    };
+    unsigned int id;
+    unsigned int fallback_id;
+
+    n = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      uint32_t ref = reader.get<uint32_t>();
+      int c = reader.get<int32_t>();
+      uint32_t fallback_ref = reader.get<uint32_t>();
+      if (face(ref, id) && face(fallback_ref, fallback_id)) {
+        metrics.fallbacks.restore({id, c}, font_settings(face_files[fallback_ref],
+                                                         face_indices[fallback_ref]));
+      }
+    }
+
+    n = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      uint32_t ref = reader.get<uint32_t>();
+      std::string features = reader.get_string();
+      double size = reader.get<double>();
+      int c = reader.get<int32_t>();
+      CharMetric metric;
+      metric.ascent = reader.get<double>();
+      metric.descent = reader.get<double>();
+      metric.width = reader.get<double>();
+      if (face(ref, id)) {
+        metrics.chars.restore({id, features, size, c}, metric);
+      }
+    }
+
+    n = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      uint32_t ref = reader.get<uint32_t>();
+      std::string features = reader.get_string();
+      double size = reader.get<double>();
+      std::string string = reader.get_string();
+      double width = reader.get<double>();
+      if (face(ref, id)) {
+        metrics.strings.restore({id, features, size, string}, width);
+      }
+    }
+
+    n = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      GlyphKey key = reader.get<GlyphKey>();
+      GlyphMetrics metric;
+      metric.bounds = reader.get<agg::rect_i>();
+      metric.advance_x = reader.get<double>();
+      metric.advance_y = reader.get<double>();
+      metric.colour = reader.get<uint8_t>() != 0;
+      if (face(key.face, id)) {
+        key.face = id;
+        metrics.glyphs.restore(key, metric);
+      }
+    }
+
+    n = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < n && reader.good(); ++i) {
+      GlyphKey key = reader.get<GlyphKey>();
+      int data_type = reader.get<int32_t>();
+      agg::rect_i bounds = reader.get<agg::rect_i>();
+      double advance_x = reader.get<double>();
+      double advance_y = reader.get<double>();
+      uint32_t data_size = reader.get<uint32_t>();
+      const unsigned char* glyph_data = reader.get_bytes(data_size);
+      if (!face(key.face, id)) {
+        continue;
+      }
+      key.face = id;
+      agg::glyph_cache* glyph = atlas.restore(key, data_size);
+      if (glyph == NULL) {
+        continue;
+      }
+      memcpy(glyph->data, glyph_data, data_size);
+      glyph->data_type = agg::glyph_data_type(data_type);
+      glyph->bounds = bounds;
+      glyph->advance_x = advance_x;
+      glyph->advance_y = advance_y;
+    }
+    return reader.good();
+  }
+};
+
+inline DiskCache& get_disk_cache() {
+  static DiskCache cache;
+  return cache;
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <stdio.h>
+#include <memory>
+#include <stdexcept>
 
 #ifdef _WIN32
-#include <Rinternals.h>
+#include <vector>
 #include <windows.h>
 #endif
 
@@ -13,26 +15,34 @@ inline FILE* unicode_fopen(const char* path, const char* mode) {
   FILE* out;
 #ifdef _WIN32
   // First conver the mode to the wide equivalent
-  // Only usage is 2 characters so max 8 bytes + 2 byte null.
+  // Modes are at most 3 characters so max 8 bytes + 2 byte null.
   wchar_t mode_w[10];
   MultiByteToWideChar(CP_UTF8, 0, mode, -1, mode_w, 9);
   
-  // Then convert the path
-  wchar_t* buf;
-  size_t len = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  // Then convert the path. This may be called from the threads writing pages
+  // in the background, so failures are signalled by returning NULL rather than
+  // through the R API
+  int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
   if (len <= 0) {
-    Rf_error("Cannot convert file to Unicode: %s", path);
+    return NULL;
   }
-  buf = (wchar_t*)R_alloc(len, sizeof(wchar_t));
-  if (buf == NULL) {
-    Rf_error("Could not allocate buffer of size: %zu", len);
-  }
-  
-  MultiByteToWideChar(CP_UTF8, 0, path, -1, buf, len);
-  out = _wfopen(buf, mode_w);
+  std::vector<wchar_t> buf(len);
+  MultiByteToWideChar(CP_UTF8, 0, path, -1, buf.data(), len);
+  out = _wfopen(buf.data(), mode_w);
 #else
   out = fopen(path, mode);
 #endif
   
   return out;
 }
+
+using FilePtr = std::unique_ptr<FILE, int(*)(FILE*)>;
+
+// Open a file that is closed when it goes out of scope, throwing on failure
+inline FilePtr make_file(const char* filename, const char* mode) {
+  FILE* f = unicode_fopen(filename, mode);
+  if (!f) {
+    throw std::runtime_error("Failed to open file");
+  }
+  return FilePtr(f, fclose);
+}
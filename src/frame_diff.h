@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// A rectangle of a frame, in pixels
+struct FrameRect {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+/* The smallest rectangle holding all pixels that differ between two frames
+ * with the same layout, used by the animation devices to only encode the part
+ * of a page that changed. Rows are compared in full first, so only the rows
+ * between the first and last changed one are searched for the left and right
+ * edge. The left and top edge are rounded down to a multiple of align for
+ * formats that store frame offsets in coarser units. The rectangle is empty if
+ * the frames are identical
+ */
+inline FrameRect changed_rect(const unsigned char* prev, const unsigned char* cur,
+                              int width, int height, int bpp, int align = 1) {
+  size_t row_bytes = size_t(width) * bpp;
+  int top = 0;
+  while (top < height &&
+         std::memcmp(prev + top * row_bytes, cur + top * row_bytes, row_bytes) == 0) {
+    ++top;
+  }
+  if (top == height) {
+    return {0, 0, 0, 0};
+  }
+  int bottom = height - 1;
+  while (bottom > top &&
+         std::memcmp(prev + bottom * row_bytes, cur + bottom * row_bytes, row_bytes) == 0) {
+    --bottom;
+  }
+  int left = width;
+  int right = -1;
+  for (int y = top; y <= bottom; ++y) {
+    const unsigned char* a = prev + y * row_bytes;
+    const unsigned char* b = cur + y * row_bytes;
+    int x = 0;
+    while (x < left && std::memcmp(a + x * bpp, b + x * bpp, bpp) == 0) ++x;
+    left = std::min(left, x);
+    x = width - 1;
+    while (x > right && std::memcmp(a + x * bpp, b + x * bpp, bpp) == 0) --x;
+    right = std::max(right, x);
+  }
+  left -= left % align;
+  top -= top % align;
+  return {left, top, right - left + 1, bottom - top + 1};
+}
+
+/* The pages of an animation that is written one frame at a time. Each page is
+ * compared with the previous one so only the rectangle that changed has to be
+ * encoded, and the encoded frame is held back until a later page differs, as
+ * only then is it known how long it is shown. A pixel is made of n_comp values
+ * of type PIXEL
+ */
+template<class PIXEL>
+class FrameSequence {
+public:
+  // An encoded frame and its placement on the canvas
+  struct Frame {
+    std::vector<unsigned char> data;
+    FrameRect rect;
+    int duration;
+  };
+
+  FrameSequence(int width, int height, int n_comp, int delay, int max_duration,
+                int align = 1) :
+    width(width),
+    height(height),
+    n_comp(n_comp),
+    delay(delay),
+    max_duration(max_duration),
+    align(align)
+  {
+    pending.duration = 0;
+  }
+
+  // The buffer the next page is converted into
+  PIXEL* page() {
+    current.resize(size_t(width) * height * n_comp);
+    return current.data();
+  }
+
+  // Find the rectangle of the page that must be encoded. The first page is
+  // encoded in full. Returns false if the page is identical to the previous
+  // one, which is shown longer instead. If the duration can't grow any further
+  // a single pixel is repeated
+  bool changed(FrameRect& rect) {
+    rect = {0, 0, width, height};
+    if (canvas.empty()) {
+      return true;
+    }
+    rect = changed_rect((const unsigned char*) canvas.data(),
+                        (const unsigned char*) current.data(), width, height,
+                        n_comp * sizeof(PIXEL), align);
+    if (rect.width > 0) {
+      return true;
+    }
+    if (pending.duration + delay <= max_duration) {
+      pending.duration += delay;
+      return false;
+    }
+    rect = {0, 0, 1, 1};
+    return true;
+  }
+
+  // Add the encoded rectangle of the page as the next frame. The previous frame
+  // is complete and handed to write_frame first. Returns false if that failed
+  template<class WRITE_FUN>
+  bool add(std::vector<unsigned char>& data, const FrameRect& rect,
+           const WRITE_FUN& write_frame) {
+    if (!canvas.empty() && !write_frame(pending)) {
+      return false;
+    }
+    pending.data.swap(data);
+    pending.rect = rect;
+    pending.duration = delay;
+    canvas.swap(current);
+    return true;
+  }
+
+  bool empty() const {
+    return canvas.empty();
+  }
+
+  // The frame that is still to be written
+  const Frame& last() const {
+    return pending;
+  }
+
+private:
+  const int width;
+  const int height;
+  const int n_comp;
+  const int delay;
+  const int max_duration;
+  const int align;
+  Frame pending;
+  std::vector<PIXEL> canvas;
+  std::vector<PIXEL> current;
+};
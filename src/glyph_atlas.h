@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "agg_font_freetype.h"
+#include "agg_trans_affine.h"
+
+// Number of horizontal subpixel positions a glyph bitmap is rendered at
+static const int GLYPH_SUBPIXEL_BINS = 4;
+// Default memory budget for rendered glyphs (32Mb)
+static const size_t GLYPH_ATLAS_DEFAULT_BUDGET = 1 << 25;
+// Rendering mode used for colour glyphs that have been resampled to their final
+// device resolution. The glyph data is then premultiplied RGBA and the bounds
+// give the pixel offset and dimensions of the bitmap
+static const int GLYPH_DEVICE_BITMAP = -1;
+
+/* A glyph is identified by the face it comes from, the size it is rendered
+ * at, the rotation it is rendered with (in 1/64 degrees), and the subpixel
+ * offset it has been shifted by before rasterization. The offset is encoded as
+ * x_bin + y_bin * GLYPH_SUBPIXEL_BINS as rotated glyphs are binned in both
+ * directions. The rendering mode is part of the key as the same glyph may be
+ * requested both as a bitmap and as an outline. scale is the fixed point
+ * (16.16) scaling applied to bitmap fonts, or 0 if it doesn't apply
+ */
+struct GlyphKey {
+  unsigned int face;
+  int size;
+  int rot;
+  unsigned int index;
+  int bin;
+  int rendering;
+  int scale;
+
+  bool operator==(const GlyphKey& other) const {
+    return index == other.index &&
+      face == other.face &&
+      size == other.size &&
+      rot == other.rot &&
+      bin == other.bin &&
+      rendering == other.rendering &&
+      scale == other.scale;
+  }
+};
+
+struct GlyphKeyHash {
+  size_t operator()(const GlyphKey& key) const {
+    uint64_t h = 1469598103934665603ULL;
+    const uint64_t prime = 1099511628211ULL;
+    h = (h ^ key.face) * prime;
+    h = (h ^ (uint32_t) key.size) * prime;
+    h = (h ^ (uint32_t) key.rot) * prime;
+    h = (h ^ key.index) * prime;
+    h = (h ^ (uint32_t) key.bin) * prime;
+    h = (h ^ (uint32_t) key.rendering) * prime;
+    h = (h ^ (uint32_t) key.scale) * prime;
+    return (size_t) h;
+  }
+};
+
+struct GlyphEntry {
+  GlyphKey key;
+  agg::glyph_cache glyph;
+  std::unique_ptr<agg::int8u[]> data;
+  size_t bytes;
+};
+
+/* The glyph atlas is a process-wide store of rendered glyph data that replaces
+ * the per-signature font caches of AGG. All faces and sizes share a single
+ * memory budget and are evicted in least-recently-used order, so mixing many
+ * fonts and sizes only evicts the glyphs that haven't been used for a while.
+ *
+ * Glyphs are returned as agg::glyph_cache pointers so they can be passed
+ * directly to the serialized scanline and path adaptors. A returned pointer is
+ * valid until the second next glyph is added, i.e. the most recently used glyph
+ * is never evicted so it can be used to derive a new glyph.
+ */
+class GlyphAtlas {
+  typedef std::list<GlyphEntry> entry_list;
+  typedef std::unordered_map<GlyphKey, entry_list::iterator, GlyphKeyHash> entry_map;
+
+  entry_list entries;
+  entry_map lookup;
+  std::unordered_map<std::string, unsigned int> faces;
+  std::vector<std::pair<std::string, unsigned int>> face_files;
+
+  size_t max_bytes;
+  size_t cur_bytes;
+  int holds;
+
+public:
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+
+  GlyphAtlas() :
+    max_bytes(GLYPH_ATLAS_DEFAULT_BUDGET),
+    cur_bytes(0),
+    holds(0),
+    hits(0),
+    misses(0),
+    evictions(0)
+  {}
+
+  // Get a stable integer id for a font file and face index
+  unsigned int face_id(const char* file, unsigned int index) {
+    std::string name(file);
+    name += '\n';
+    name += std::to_string(index);
+    auto it = faces.find(name);
+    if (it != faces.end()) {
+      return it->second;
+    }
+    unsigned int id = faces.size();
+    faces[name] = id;
+    face_files.emplace_back(file, index);
+    return id;
+  }
+
+  // The font file and face index a face id was created from
+  bool face_file(unsigned int id, std::string& file, unsigned int& index) const {
+    if (id >= face_files.size()) {
+      return false;
+    }
+    file = face_files[id].first;
+    index = face_files[id].second;
+    return true;
+  }
+
+  // Look up a glyph, rendering it with the engine if it isn't present. The
+  // engine must have the face and size of the key loaded. mtx is the transform
+  // the glyph is rendered with and must correspond to the rot and bin of the key
+  template<class ENGINE>
+  const agg::glyph_cache* glyph(ENGINE& engine, const GlyphKey& key,
+                                const agg::trans_affine& mtx) {
+    const agg::glyph_cache* cached = find(key);
+    if (cached != NULL) {
+      return cached;
+    }
+
+    engine.transform(mtx);
+    if (!engine.prepare_glyph(key.index)) {
+      return NULL;
+    }
+
+    agg::glyph_cache* glyph = insert(key, engine.data_size());
+    engine.write_glyph_to(glyph->data);
+    glyph->glyph_index = engine.glyph_index();
+    glyph->data_type = engine.data_type();
+    glyph->bounds = engine.bounds();
+    glyph->advance_x = engine.advance_x();
+    glyph->advance_y = engine.advance_y();
+
+    return glyph;
+  }
+
+  // Check whether a glyph is present without counting it as a use
+  bool has(const GlyphKey& key) const {
+    return lookup.find(key) != lookup.end();
+  }
+
+  // Look up a glyph without rendering it on a miss
+  const agg::glyph_cache* find(const GlyphKey& key) {
+    auto it = lookup.find(key);
+    if (it == lookup.end()) {
+      return NULL;
+    }
+    hits++;
+    if (it->second != entries.begin()) {
+      entries.splice(entries.begin(), entries, it->second);
+    }
+    return &(it->second->glyph);
+  }
+
+  // Add a glyph with room for data_size bytes of data which the caller must
+  // fill in along with the remaining glyph fields
+  agg::glyph_cache* insert(const GlyphKey& key, unsigned int data_size) {
+    misses++;
+    size_t bytes = entry_bytes(data_size);
+    evict(max_bytes > bytes ? max_bytes - bytes : 0);
+
+    entries.emplace_front();
+    return &(init_entry(entries.begin(), key, data_size));
+  }
+
+  // Add a glyph that was rendered elsewhere (e.g. read from the disk cache) as
+  // the least recently used one. Nothing is evicted to make room for it, so
+  // NULL is returned if it doesn't fit in the budget or is already present
+  agg::glyph_cache* restore(const GlyphKey& key, unsigned int data_size) {
+    if (has(key) || cur_bytes + entry_bytes(data_size) > max_bytes) {
+      return NULL;
+    }
+    entries.emplace_back();
+    return &(init_entry(std::prev(entries.end()), key, data_size));
+  }
+
+  // Call fun(key, glyph) for all glyphs, starting with the most recently used
+  template<typename FUN>
+  void each(FUN fun) const {
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      fun(it->key, it->glyph);
+    }
+  }
+
+  void budget(size_t bytes) {
+    max_bytes = bytes;
+    evict(max_bytes);
+  }
+  size_t budget() const {
+    return max_bytes;
+  }
+  size_t size() const {
+    return cur_bytes;
+  }
+  size_t n_glyphs() const {
+    return entries.size();
+  }
+
+  // While held, no glyphs are evicted so that pointers to several glyphs can be
+  // kept at once. The budget is enforced again once all holds are released
+  void hold() {
+    holds++;
+  }
+  void release() {
+    if (holds > 0 && --holds == 0) {
+      evict(max_bytes);
+    }
+  }
+
+  void clear() {
+    lookup.clear();
+    entries.clear();
+    cur_bytes = 0;
+  }
+
+private:
+  static size_t entry_bytes(unsigned int data_size) {
+    return data_size + sizeof(GlyphEntry) + sizeof(GlyphKey);
+  }
+
+  agg::glyph_cache& init_entry(entry_list::iterator it, const GlyphKey& key,
+                               unsigned int data_size) {
+    GlyphEntry& entry = *it;
+    entry.key = key;
+    entry.data.reset(new agg::int8u[data_size]);
+    entry.glyph.glyph_index = key.index;
+    entry.glyph.data = entry.data.get();
+    entry.glyph.data_size = data_size;
+    entry.glyph.data_type = agg::glyph_data_invalid;
+    entry.bytes = entry_bytes(data_size);
+
+    lookup[key] = it;
+    cur_bytes += entry.bytes;
+
+    return entry.glyph;
+  }
+
+  // Evict least recently used glyphs until the limit is met. The most recent
+  // glyph is always kept as it may be in use by the caller
+  void evict(size_t limit) {
+    if (holds > 0) {
+      return;
+    }
+    while (cur_bytes > limit && entries.size() > 1) {
+      GlyphEntry& last = entries.back();
+      cur_bytes -= last.bytes;
+      lookup.erase(last.key);
+      entries.pop_back();
+      evictions++;
+    }
+  }
+};
+
+inline GlyphAtlas& get_glyph_atlas() {
+  static GlyphAtlas atlas;
+  return atlas;
+}
+
+// Holds the glyph atlas for the duration of a scope
+class GlyphAtlasHold {
+  GlyphAtlas& atlas;
+
+public:
+  GlyphAtlasHold(GlyphAtlas& a) : atlas(a) {
+    atlas.hold();
+  }
+  ~GlyphAtlasHold() {
+    atlas.release();
+  }
+};
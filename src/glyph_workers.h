@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <systemfonts.h>
+
+#include "agg_font_freetype.h"
+#include "agg_gamma_functions.h"
+#include "glyph_atlas.h"
+
+// Minimum number of missing glyphs before rendering is split across threads
+static const size_t GLYPH_PREFETCH_MIN = 16;
+
+// A glyph to be rendered by a worker. The result is copied into the glyph
+// atlas by the main thread
+struct GlyphJob {
+  GlyphKey key;
+  agg::trans_affine mtx;
+  bool ok;
+  std::vector<agg::int8u> data;
+  agg::glyph_data_type data_type;
+  agg::rect_i bounds;
+  double advance_x;
+  double advance_y;
+};
+
+/* Renders batches of glyphs that are missing from the glyph atlas on worker
+ * threads. FreeType objects can't be shared between threads, so every worker
+ * has its own engine (and thereby its own FT_Library and faces). The engines
+ * are kept between batches so faces only need to be opened once. No R API is
+ * touched from the workers and the atlas is only modified by the caller
+ */
+template<class ENGINE>
+class GlyphWorkers {
+  std::vector<std::unique_ptr<ENGINE>> engines;
+  size_t max_threads;
+
+public:
+  GlyphWorkers() :
+    max_threads(std::max(1u, std::min(4u, std::thread::hardware_concurrency())))
+  {}
+
+  void threads(size_t n) {
+    max_threads = std::max(size_t(1), n);
+  }
+  size_t threads() const {
+    return max_threads;
+  }
+
+  // Render all jobs with the given font. Jobs that could not be rendered are
+  // left with ok == false so the caller can fall back to rendering them itself
+  void render(const FontSettings& font, agg::glyph_rendering gren, double size,
+              std::vector<GlyphJob>& jobs) {
+    size_t n_threads = std::min(max_threads, jobs.size() / (GLYPH_PREFETCH_MIN / 2));
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      jobs[i].ok = false;
+    }
+    if (n_threads < 2) {
+      return;
+    }
+    while (engines.size() < n_threads) {
+      std::unique_ptr<ENGINE> engine(new ENGINE());
+      // Same settings as the engine used by TextRenderer
+      engine->hinting(true);
+      engine->flip_y(true);
+      engine->gamma(agg::gamma_power(1.6));
+      engines.push_back(std::move(engine));
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&](ENGINE* engine) {
+      try {
+        if (!engine->load_font(font.file, font.index, gren) ||
+            int(engine->rendering()) != jobs[0].key.rendering) {
+          return;
+        }
+        engine->height(size);
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+          GlyphJob& job = jobs[i];
+          engine->transform(job.mtx);
+          if (!engine->prepare_glyph(job.key.index)) {
+            continue;
+          }
+          job.data.resize(engine->data_size());
+          engine->write_glyph_to(job.data.data());
+          job.data_type = engine->data_type();
+          job.bounds = engine->bounds();
+          job.advance_x = engine->advance_x();
+          job.advance_y = engine->advance_y();
+          job.ok = true;
+        }
+      } catch (...) {
+        // Jobs not marked as ok will be rendered by the main thread
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < n_threads; ++i) {
+      try {
+        pool.emplace_back(work, engines[i].get());
+      } catch (...) {
+        break;
+      }
+    }
+    work(engines[0].get());
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool[i].join();
+    }
+  }
+};
@@ -4,24 +4,61 @@
 
 #include <Rinternals.h>
 #include <stdlib.h> // for NULL
+#include <vector>
 #include <R_ext/Rdynload.h>
 #include <systemfonts.h>
 #include "ragg.h"
+#include "bulk_api.h"
+#include "disk_cache.h"
+#include "page_workers.h"
 
 static const R_CallMethodDef CallEntries[] = {
   {"agg_ppm_c", (DL_FUNC) &agg_ppm_c, 8},
-  {"agg_png_c", (DL_FUNC) &agg_png_c, 9},
+  {"agg_qoi_c", (DL_FUNC) &agg_qoi_c, 8},
+  {"agg_png_c", (DL_FUNC) &agg_png_c, 13},
   {"agg_webp_c", (DL_FUNC) &agg_webp_c, 10},
   {"agg_webp_anim_c", (DL_FUNC)&agg_webp_anim_c, 12},
+  {"agg_apng_c", (DL_FUNC) &agg_apng_c, 12},
   {"agg_supertransparent_c", (DL_FUNC) &agg_supertransparent_c, 9},
-  {"agg_tiff_c", (DL_FUNC) &agg_tiff_c, 11},
+  {"agg_tiff_c", (DL_FUNC) &agg_tiff_c, 15},
   {"agg_jpeg_c", (DL_FUNC) &agg_jpeg_c, 11},
   {"agg_capture_c", (DL_FUNC) &agg_capture_c, 8},
+  {"agg_capture_region_c", (DL_FUNC) &agg_capture_region_c, 3},
+  {"agg_shm_c", (DL_FUNC) &agg_shm_c, 8},
+  {"agg_rawvideo_c", (DL_FUNC) &agg_rawvideo_c, 9},
   {"agg_record_c", (DL_FUNC) &agg_record_c, 8},
+  {"agg_glyph_cache_info_c", (DL_FUNC) &agg_glyph_cache_info_c, 0},
+  {"agg_flush_cache_c", (DL_FUNC) &agg_flush_cache_c, 0},
+  {"agg_memory_pages_c", (DL_FUNC) &agg_memory_pages_c, 1},
   {NULL, NULL, 0}
 };
 
+// Unsupported entry points only used by the tests, defined in api_test.cpp
+extern const R_CallMethodDef TestCallEntries[];
+
 extern "C" void R_init_ragg(DllInfo *dll) {
-  R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
+  std::vector<R_CallMethodDef> entries;
+  for (const R_CallMethodDef* entry = CallEntries; entry->name; ++entry) {
+    entries.push_back(*entry);
+  }
+  for (const R_CallMethodDef* entry = TestCallEntries; entry->name; ++entry) {
+    entries.push_back(*entry);
+  }
+  entries.push_back({NULL, NULL, 0});
+  R_registerRoutines(dll, NULL, entries.data(), NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
+
+  R_RegisterCCallable("ragg", "ragg_draw_text", (DL_FUNC)ragg_draw_text);
+  R_RegisterCCallable("ragg", "ragg_draw_points", (DL_FUNC)ragg_draw_points);
+  R_RegisterCCallable("ragg", "ragg_draw_segments", (DL_FUNC)ragg_draw_segments);
+  R_RegisterCCallable("ragg", "ragg_draw_rects", (DL_FUNC)ragg_draw_rects);
+  R_RegisterCCallable("ragg", "ragg_device_buffer", (DL_FUNC)ragg_device_buffer);
+}
+
+extern "C" void R_unload_ragg(DllInfo *dll) {
+  // Changes to the persistent font cache must be written while the code is
+  // still around
+  get_disk_cache().save(true);
+  // Worker threads must not outlive the code they run
+  get_page_workers().shutdown();
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "ragg.h"
+#include "disk_cache.h"
+#include "bulk_api.h"
 #include <cstddef>
 #include <memory>
 
@@ -46,6 +48,7 @@ void agg_close(pDevDesc dd) {
   BEGIN_CPP
   auto deleter = [dd](T* ptr) {
     if (dd != NULL) {
+      unregister_bulk_target(dd);
       dd->deviceSpecific = NULL;
     }
     delete ptr;
@@ -53,6 +56,9 @@ void agg_close(pDevDesc dd) {
   std::unique_ptr<T, decltype(deleter)> guard(device, deleter);
   device->close();
   guard.reset();
+  if (!get_disk_cache().save()) {
+    Rf_warning("agg could not write to the font cache file: %s", get_disk_cache().path().c_str());
+  }
   END_CPP
 
   return;
@@ -547,6 +553,7 @@ pDevDesc agg_device_new(T* device, bool record = FALSE) {
 
   device->device_id = DEVICE_COUNTER++;
   dd->deviceSpecific = device;
+  register_bulk_target(dd, new BulkTargetDevice<T>(device));
 
   return dd;
 }
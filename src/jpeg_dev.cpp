@@ -9,9 +9,17 @@ SEXP agg_jpeg_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                 SEXP method) {
   int bgCol = RGBpar(bg, 0);
   
+#if !(JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED))
+  if (Rf_isNull(file)) {
+    Rf_error("In-memory JPEG output requires libjpeg 8 or libjpeg-turbo");
+  }
+#endif
+  
+  PageStorePtr store = page_store_for(file);
+  
   BEGIN_CPP
     AggDeviceJpegNoAlpha* device = new AggDeviceJpegNoAlpha(
-      Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+      page_file_name(file), 
       INTEGER(width)[0], 
       INTEGER(height)[0], 
       REAL(pointsize)[0], 
@@ -23,8 +31,9 @@ SEXP agg_jpeg_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
       INTEGER(smoothing)[0],
       INTEGER(method)[0]
     );
+  device->page_store = store;
   makeDevice<AggDeviceJpegNoAlpha>(device, "agg_jpeg");
   END_CPP
     
-  return R_NilValue;
+  return page_store_xptr(store);
 }
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <systemfonts.h>
+
+#include "glyph_atlas.h"
+
+// A simple least-recently-used map with a fixed number of entries
+template<typename KEY, typename VALUE, typename HASH = std::hash<KEY>>
+class LRUCache {
+  typedef std::pair<KEY, VALUE> item_type;
+  typedef std::list<item_type> item_list;
+
+  item_list items;
+  std::unordered_map<KEY, typename item_list::iterator, HASH> lookup;
+  size_t max_size;
+  size_t n_added;
+
+public:
+  LRUCache(size_t size) : max_size(size), n_added(0) {}
+
+  bool get(const KEY& key, VALUE& value) {
+    auto it = lookup.find(key);
+    if (it == lookup.end()) {
+      return false;
+    }
+    if (it->second != items.begin()) {
+      items.splice(items.begin(), items, it->second);
+    }
+    value = it->second->second;
+    return true;
+  }
+
+  void add(const KEY& key, const VALUE& value) {
+    auto it = lookup.find(key);
+    if (it != lookup.end()) {
+      it->second->second = value;
+      items.splice(items.begin(), items, it->second);
+      return;
+    }
+    items.emplace_front(key, value);
+    lookup[key] = items.begin();
+    n_added++;
+    if (items.size() > max_size) {
+      lookup.erase(items.back().first);
+      items.pop_back();
+    }
+  }
+
+  // Add an entry as the least recently used one if there is room for it
+  void restore(const KEY& key, const VALUE& value) {
+    if (items.size() >= max_size || lookup.find(key) != lookup.end()) {
+      return;
+    }
+    items.emplace_back(key, value);
+    lookup[key] = std::prev(items.end());
+  }
+
+  // Call fun(key, value) for all entries, starting with the most recently used
+  template<typename FUN>
+  void each(FUN fun) const {
+    for (auto it = items.begin(); it != items.end(); ++it) {
+      fun(it->first, it->second);
+    }
+  }
+
+  // Number of entries added with add() since the cache was created
+  size_t added() const {
+    return n_added;
+  }
+
+  size_t size() const {
+    return items.size();
+  }
+
+  void clear() {
+    lookup.clear();
+    items.clear();
+  }
+};
+
+// The OpenType features of a font packed into a string, which is empty for
+// fonts without features
+inline std::string font_features(const FontSettings& font) {
+  std::string features;
+  for (int i = 0; i < font.n_features; ++i) {
+    features.append(font.features[i].feature, 4);
+    features.append((const char*) &font.features[i].setting, sizeof(int));
+  }
+  return features;
+}
+
+/* Metrics are keyed on the face id given by the glyph atlas, the OpenType
+ * features of the font (as several families may be registered on the same file
+ * with different features), the font size, and either a code point or a
+ * string. Fallback fonts are resolved once per face and code point as they
+ * don't depend on the features
+ */
+struct CharMetricKey {
+  unsigned int face;
+  std::string features;
+  double size;
+  int c;
+
+  bool operator==(const CharMetricKey& other) const {
+    return c == other.c && face == other.face && size == other.size &&
+      features == other.features;
+  }
+};
+struct CharMetricKeyHash {
+  size_t operator()(const CharMetricKey& key) const {
+    return std::hash<int>()(key.c) ^ (std::hash<double>()(key.size) << 1) ^
+      (std::hash<unsigned int>()(key.face) << 2) ^
+      (std::hash<std::string>()(key.features) << 3);
+  }
+};
+
+struct CharMetric {
+  double ascent;
+  double descent;
+  double width;
+};
+
+struct StringWidthKey {
+  unsigned int face;
+  std::string features;
+  double size;
+  std::string string;
+
+  bool operator==(const StringWidthKey& other) const {
+    return face == other.face && size == other.size && string == other.string &&
+      features == other.features;
+  }
+};
+struct StringWidthKeyHash {
+  size_t operator()(const StringWidthKey& key) const {
+    return std::hash<std::string>()(key.string) ^
+      (std::hash<double>()(key.size) << 1) ^
+      (std::hash<unsigned int>()(key.face) << 2) ^
+      (std::hash<std::string>()(key.features) << 3);
+  }
+};
+
+struct FallbackKey {
+  unsigned int face;
+  int c;
+
+  bool operator==(const FallbackKey& other) const {
+    return c == other.c && face == other.face;
+  }
+};
+struct FallbackKeyHash {
+  size_t operator()(const FallbackKey& key) const {
+    return std::hash<int>()(key.c) ^ (std::hash<unsigned int>()(key.face) << 1);
+  }
+};
+
+// Metrics of a glyph loaded without rendering it
+struct GlyphMetrics {
+  agg::rect_i bounds;
+  double advance_x;
+  double advance_y;
+  bool colour;
+};
+
+// Process-wide cache of the metrics requested by the graphics engine during
+// layout, so repeated requests need neither font loading nor glyph rendering
+class MetricCache {
+public:
+  LRUCache<CharMetricKey, CharMetric, CharMetricKeyHash> chars;
+  LRUCache<StringWidthKey, double, StringWidthKeyHash> strings;
+  LRUCache<FallbackKey, FontSettings, FallbackKeyHash> fallbacks;
+  LRUCache<GlyphKey, GlyphMetrics, GlyphKeyHash> glyphs;
+
+  MetricCache() :
+    chars(4096),
+    strings(4096),
+    fallbacks(1024),
+    glyphs(4096)
+  {}
+
+  void clear() {
+    chars.clear();
+    strings.clear();
+    fallbacks.clear();
+    glyphs.clear();
+  }
+};
+
+inline MetricCache& get_metric_cache() {
+  static MetricCache cache;
+  return cache;
+}
@@ -0,0 +1,14 @@
+#include "ragg.h"
+#include "page_store.h"
+
+// [[export]]
+SEXP agg_memory_pages_c(SEXP store) {
+  PageStorePtr* ptr = (PageStorePtr*) R_ExternalPtrAddr(store);
+  if (ptr == NULL) {
+    Rf_error("The pages of this device are no longer available");
+  }
+  BEGIN_CPP
+  return (*ptr)->take();
+  END_CPP
+  return R_NilValue;
+}
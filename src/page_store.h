@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ragg.h"
+
+/* Encoded pages kept in memory instead of being written to files, for devices
+ * opened without a file name. Pages are added by whichever thread encodes them
+ * and taken out by R as raw vectors, through the function returned when the
+ * device was opened. The store is shared between the device and that function,
+ * so pages can still be collected after the device has been closed
+ */
+class PageStore {
+  std::mutex mutex;
+  std::map<int, std::vector<unsigned char>> pages;
+
+public:
+  void add(int page, std::vector<unsigned char>& data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pages[page].swap(data);
+  }
+
+  // The pages added since the last call, in page order, as a list of raw
+  // vectors. Must be called on the main thread. R allocations may longjmp, so
+  // all vectors are allocated before any page is taken out of the store and no
+  // C++ object is alive while R allocates
+  SEXP take() {
+    R_xlen_t n = size();
+    SEXP keys = PROTECT(Rf_allocVector(INTSXP, n));
+    SEXP sizes = PROTECT(Rf_allocVector(REALSXP, n));
+    n = describe(INTEGER(keys), REAL(sizes), n);
+    SEXP list = PROTECT(Rf_allocVector(VECSXP, n));
+    for (R_xlen_t i = 0; i < n; ++i) {
+      SET_VECTOR_ELT(list, i, Rf_allocVector(RAWSXP, (R_xlen_t) REAL(sizes)[i]));
+    }
+    fill(INTEGER(keys), list, n);
+    UNPROTECT(3);
+    return list;
+  }
+
+private:
+  R_xlen_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pages.size();
+  }
+
+  // Record the number and size of at most n pages, returning how many there
+  // were. Pages are only removed by take(), so they are still there for fill()
+  R_xlen_t describe(int* keys, double* sizes, R_xlen_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    R_xlen_t i = 0;
+    for (auto it = pages.begin(); it != pages.end() && i < n; ++it, ++i) {
+      keys[i] = it->first;
+      sizes[i] = it->second.size();
+    }
+    return i;
+  }
+
+  // Move the described pages into the raw vectors of list
+  void fill(const int* keys, SEXP list, R_xlen_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (R_xlen_t i = 0; i < n; ++i) {
+      auto it = pages.find(keys[i]);
+      if (!it->second.empty()) {
+        std::memcpy(RAW(VECTOR_ELT(list, i)), it->second.data(), it->second.size());
+      }
+      pages.erase(it);
+    }
+  }
+};
+
+typedef std::shared_ptr<PageStore> PageStorePtr;
+
+// A new store if the device is opened without a file, i.e. file is NULL
+inline PageStorePtr page_store_for(SEXP file) {
+  return Rf_isNull(file) ? std::make_shared<PageStore>() : PageStorePtr();
+}
+
+// The file name passed to the device constructors
+inline const char* page_file_name(SEXP file) {
+  return Rf_isNull(file) ? "" : Rf_translateCharUTF8(STRING_ELT(file, 0));
+}
+
+inline void finalize_page_store(SEXP ptr) {
+  delete (PageStorePtr*) R_ExternalPtrAddr(ptr);
+  R_ClearExternalPtr(ptr);
+}
+
+// Wrap a store in an external pointer for R, or return NULL if there is none
+inline SEXP page_store_xptr(const PageStorePtr& store) {
+  if (!store) {
+    return R_NilValue;
+  }
+  SEXP ptr = PROTECT(R_MakeExternalPtr(new PageStorePtr(store), R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, finalize_page_store, TRUE);
+  UNPROTECT(1);
+  return ptr;
+}
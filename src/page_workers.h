@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ragg.h"
+
+/* A pool of threads encoding finished pages in the background. Threads are
+ * started as pages are queued, up to a fixed maximum, and then wait for new
+ * jobs until the pool is shut down. The pool is shared by all devices. Jobs run
+ * outside of R and must not touch the R API
+ */
+class PageWorkers {
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<std::function<void()>> jobs;
+  std::vector<std::thread> threads;
+  size_t max_threads;
+  size_t idle;
+  bool stopping;
+
+public:
+  PageWorkers() :
+    max_threads(std::max(1u, std::min(4u, std::thread::hardware_concurrency()))),
+    idle(0),
+    stopping(false)
+  {}
+  ~PageWorkers() {
+    shutdown();
+  }
+
+  void submit(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+    if (jobs.size() <= idle || threads.size() >= max_threads) {
+      available.notify_one();
+      return;
+    }
+    try {
+      threads.emplace_back(&PageWorkers::run, this);
+    } catch (...) {
+      if (!threads.empty()) {
+        return;
+      }
+      // No thread could be started, so do the work on the calling thread
+      std::function<void()> own = std::move(jobs.back());
+      jobs.pop_back();
+      lock.unlock();
+      own();
+    }
+  }
+
+  // Finish the queued jobs and join all threads. Must be called from the main
+  // thread, e.g. before the package code is unloaded. The pool can be used
+  // again afterwards
+  void shutdown() {
+    std::vector<std::thread> running;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      running.swap(threads);
+    }
+    available.notify_all();
+    for (size_t i = 0; i < running.size(); ++i) {
+      running[i].join();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = false;
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      idle++;
+      available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      idle--;
+      if (jobs.empty()) {
+        return;
+      }
+      std::function<void()> job = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+};
+
+inline PageWorkers& get_page_workers() {
+  static PageWorkers workers;
+  return workers;
+}
+
+/* The pages of a single device that are being encoded in the background. When
+ * a page is finished the device hands its buffer over and continues drawing in
+ * a spare one, so at most depth + 1 frame buffers exist at any time. If the
+ * queue is full the device waits for a page to be written before it continues.
+ * Failures are collected and reported as warnings on the main thread, at the
+ * next page or when the device is closed
+ */
+class PageQueue {
+  std::mutex mutex;
+  std::condition_variable finished;
+  size_t max_pending;
+  size_t pending;
+  std::vector<unsigned char*> spare;
+  std::vector<std::string> errors;
+
+public:
+  PageQueue() : max_pending(0), pending(0) {}
+  ~PageQueue() {
+    wait(0);
+    for (size_t i = 0; i < spare.size(); ++i) {
+      delete [] spare[i];
+    }
+  }
+
+  // The number of pages that may be queued. 0 means that pages are written
+  // synchronously
+  void depth(size_t n) {
+    max_pending = n;
+  }
+  bool enabled() const {
+    return max_pending > 0;
+  }
+
+  // Get a buffer of the given size to continue drawing in, waiting for room in
+  // the queue if necessary
+  unsigned char* acquire(size_t size) {
+    wait(max_pending - 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (spare.empty()) {
+      return new unsigned char[size];
+    }
+    unsigned char* buffer = spare.back();
+    spare.pop_back();
+    return buffer;
+  }
+
+  // Encode a page on a worker. The frame buffer is recycled once job is done
+  void submit(std::function<bool()> job, unsigned char* frame, int page) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending++;
+    }
+    get_page_workers().submit([this, job, frame, page]() {
+      bool ok = false;
+      try {
+        ok = job();
+      } catch (...) {
+        ok = false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!ok) {
+        char msg[64];
+        snprintf(msg, 64, "agg could not write page %i to the given file", page);
+        errors.push_back(msg);
+      }
+      spare.push_back(frame);
+      pending--;
+      finished.notify_all();
+    });
+  }
+
+  // Record a failure. Can be called from any thread
+  void fail(const std::string& msg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    errors.push_back(msg);
+  }
+
+  void wait(size_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this, n]() { return pending <= n; });
+  }
+
+  // Emit the collected failures as warnings. Must be called on the main thread
+  void report() {
+    std::vector<std::string> msgs;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      msgs.swap(errors);
+    }
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      Rf_warning("%s", msgs[i].c_str());
+    }
+  }
+};
+
+// The queue depth for new devices as set by the ragg.async_pages option
+inline size_t async_page_depth() {
+  SEXP depth = Rf_GetOption1(Rf_install("ragg.async_pages"));
+  if (Rf_isNumeric(depth) && Rf_length(depth) == 1) {
+    int n = Rf_asInteger(depth);
+    if (n > 0) {
+      return n;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+// Amount of image data compressed as one block, and the size of the deflate
+// window that can be primed from the previous block
+static const size_t PNG_DEFLATE_BLOCK = 1 << 18;
+static const size_t PNG_DEFLATE_WINDOW = 1 << 15;
+
+// How rows are filtered. Adaptive picks the filter with the smallest sum of
+// absolute values for every row, like libpng does by default
+enum PngRowFilter {
+  PNG_ROW_FILTER_NONE = 0,
+  PNG_ROW_FILTER_SUB = 1,
+  PNG_ROW_FILTER_ADAPTIVE = 5
+};
+
+/* Filters and deflates the image data of a PNG on several threads, the way
+ * pigz compresses files. The rows are split into blocks that are compressed
+ * independently as raw deflate data, each using the end of the previous block
+ * as its dictionary so that little compression is lost at the boundaries.
+ * All blocks but the last end with a sync flush, which aligns them to a byte
+ * so they can simply be concatenated. The zlib header and the checksum of all
+ * the data, combined from those of the blocks, turn this into a single zlib
+ * stream for the IDAT chunks. Rows are fetched through get_row(y, out) which
+ * is called concurrently for different rows and must be thread safe
+ */
+class PngDeflate {
+public:
+  typedef std::function<void(int, unsigned char*)> row_fun;
+
+  PngDeflate(int height, size_t row_bytes, int bpp, int filter, int level,
+             int strategy) :
+    height(height),
+    row_bytes(row_bytes),
+    bpp(bpp),
+    filter(filter),
+    level(level),
+    strategy(strategy)
+  {
+    rows_per_block = std::max(1, int(PNG_DEFLATE_BLOCK / (row_bytes + 1)));
+    dict_rows = int((PNG_DEFLATE_WINDOW + row_bytes) / (row_bytes + 1));
+  }
+
+  bool compress(const row_fun& get_row, int n_threads,
+                std::vector<unsigned char>& out) {
+    int n_blocks = (height + rows_per_block - 1) / rows_per_block;
+    std::vector<Block> blocks(n_blocks);
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+
+    auto work = [&]() {
+      try {
+        Worker worker(*this, get_row);
+        if (!worker.ok) {
+          failed = true;
+          return;
+        }
+        for (int i = next++; i < n_blocks && !failed; i = next++) {
+          if (!worker.compress(i, i == n_blocks - 1, blocks[i])) {
+            failed = true;
+          }
+        }
+      } catch (...) {
+        failed = true;
+      }
+    };
+
+    std::vector<std::thread> pool;
+    n_threads = std::max(1, std::min(n_threads, n_blocks));
+    for (int i = 1; i < n_threads; ++i) {
+      try {
+        pool.emplace_back(work);
+      } catch (...) {
+        break;
+      }
+    }
+    work();
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool[i].join();
+    }
+    if (failed) {
+      return false;
+    }
+
+    size_t size = 6;
+    for (int i = 0; i < n_blocks; ++i) {
+      size += blocks[i].data.size();
+    }
+    out.clear();
+    out.reserve(size);
+    // zlib header for a 32K window with the level hint of zlib itself
+    int flevel = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 :
+      level < 2 ? 0 : level < 6 ? 1 : 3;
+    unsigned int header = (0x78 << 8) | (flevel << 6);
+    header += 31 - header % 31;
+    out.push_back(header >> 8);
+    out.push_back(header & 0xFF);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int i = 0; i < n_blocks; ++i) {
+      out.insert(out.end(), blocks[i].data.begin(), blocks[i].data.end());
+      adler = adler32_combine(adler, blocks[i].adler, blocks[i].length);
+    }
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back((adler >> shift) & 0xFF);
+    }
+    return true;
+  }
+
+private:
+  struct Block {
+    std::vector<unsigned char> data;
+    uLong adler;
+    z_off_t length;
+  };
+
+  // The state of a single thread, reused for all the blocks it compresses
+  struct Worker {
+    const PngDeflate& self;
+    const row_fun& get_row;
+    z_stream strm;
+    bool ok;
+    std::vector<unsigned char> cur;
+    std::vector<unsigned char> prev;
+    std::vector<unsigned char> candidates;
+    std::vector<unsigned char> filtered;
+
+    Worker(const PngDeflate& self, const row_fun& get_row) :
+      self(self),
+      get_row(get_row),
+      cur(self.row_bytes),
+      prev(self.row_bytes),
+      candidates(5 * (self.row_bytes + 1))
+    {
+      std::memset(&strm, 0, sizeof(strm));
+      ok = deflateInit2(&strm, self.level, Z_DEFLATED, -15, 8,
+                        self.strategy) == Z_OK;
+    }
+    ~Worker() {
+      if (ok) {
+        deflateEnd(&strm);
+      }
+    }
+
+    bool compress(int index, bool last, Block& block) {
+      int y0 = index * self.rows_per_block;
+      int y1 = std::min(self.height, y0 + self.rows_per_block);
+      // The rows before the block are filtered again to serve as dictionary
+      int d0 = std::max(0, y0 - self.dict_rows);
+      size_t line = self.row_bytes + 1;
+      filtered.resize((y1 - d0) * line);
+      if (d0 > 0) {
+        get_row(d0 - 1, prev.data());
+      } else {
+        std::fill(prev.begin(), prev.end(), 0);
+      }
+      for (int y = d0; y < y1; ++y) {
+        get_row(y, cur.data());
+        filter_row(cur.data(), prev.data(), filtered.data() + (y - d0) * line);
+        cur.swap(prev);
+      }
+      size_t dict_length = (y0 - d0) * line;
+      unsigned char* data = filtered.data() + dict_length;
+      size_t length = filtered.size() - dict_length;
+      block.adler = adler32(adler32(0L, Z_NULL, 0), data, length);
+      block.length = length;
+
+      if (deflateReset(&strm) != Z_OK) {
+        return false;
+      }
+      if (dict_length > 0) {
+        size_t use = std::min(dict_length, PNG_DEFLATE_WINDOW);
+        if (deflateSetDictionary(&strm, data - use, use) != Z_OK) {
+          return false;
+        }
+      }
+      block.data.resize(deflateBound(&strm, length) + 16);
+      strm.next_in = data;
+      strm.avail_in = length;
+      strm.next_out = block.data.data();
+      strm.avail_out = block.data.size();
+      int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+      while (true) {
+        int res = deflate(&strm, flush);
+        if (res == Z_STREAM_ERROR) {
+          return false;
+        }
+        if (last ? res == Z_STREAM_END : strm.avail_out > 0) {
+          break;
+        }
+        size_t used = block.data.size() - strm.avail_out;
+        block.data.resize(block.data.size() * 2);
+        strm.next_out = block.data.data() + used;
+        strm.avail_out = block.data.size() - used;
+      }
+      block.data.resize(block.data.size() - strm.avail_out);
+      return true;
+    }
+
+    void filter_row(const unsigned char* row, const unsigned char* up,
+                    unsigned char* out) {
+      if (self.filter != PNG_ROW_FILTER_ADAPTIVE) {
+        apply_filter(self.filter, row, up, out);
+        return;
+      }
+      size_t line = self.row_bytes + 1;
+      size_t best = 0;
+      unsigned long best_sum = ~0ul;
+      for (int type = 0; type < 5; ++type) {
+        unsigned char* cand = candidates.data() + type * line;
+        apply_filter(type, row, up, cand);
+        unsigned long sum = 0;
+        for (size_t i = 1; i < line; ++i) {
+          sum += std::abs(int((signed char) cand[i]));
+        }
+        if (sum < best_sum) {
+          best_sum = sum;
+          best = type;
+        }
+      }
+      std::memcpy(out, candidates.data() + best * line, line);
+    }
+
+    void apply_filter(int type, const unsigned char* row,
+                      const unsigned char* up, unsigned char* out) {
+      size_t n = self.row_bytes;
+      size_t bpp = self.bpp;
+      out[0] = type;
+      out++;
+      switch (type) {
+      case 0:
+        std::memcpy(out, row, n);
+        break;
+      case 1:
+        for (size_t i = 0; i < bpp; ++i) out[i] = row[i];
+        for (size_t i = bpp; i < n; ++i) out[i] = row[i] - row[i - bpp];
+        break;
+      case 2:
+        for (size_t i = 0; i < n; ++i) out[i] = row[i] - up[i];
+        break;
+      case 3:
+        for (size_t i = 0; i < bpp; ++i) out[i] = row[i] - (up[i] >> 1);
+        for (size_t i = bpp; i < n; ++i) {
+          out[i] = row[i] - ((row[i - bpp] + up[i]) >> 1);
+        }
+        break;
+      case 4:
+        for (size_t i = 0; i < bpp; ++i) out[i] = row[i] - up[i];
+        for (size_t i = bpp; i < n; ++i) {
+          int a = row[i - bpp];
+          int b = up[i];
+          int c = up[i - bpp];
+          int pa = std::abs(b - c);
+          int pb = std::abs(a - c);
+          int pc = std::abs(a + b - 2 * c);
+          int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+          out[i] = row[i] - pred;
+        }
+        break;
+      }
+    }
+  };
+
+  int height;
+  size_t row_bytes;
+  int bpp;
+  int filter;
+  int level;
+  int strategy;
+  int rows_per_block;
+  int dict_rows;
+};
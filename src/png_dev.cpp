@@ -5,67 +5,92 @@
 
 // [[export]]
 SEXP agg_png_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg, 
-               SEXP res, SEXP scaling, SEXP snap, SEXP bit) {
+               SEXP res, SEXP scaling, SEXP snap, SEXP bit, SEXP compression,
+               SEXP palette, SEXP quantize, SEXP threads) {
   bool bit8 = INTEGER(bit)[0] == 8;
   int bgCol = RGBpar(bg, 0);
+  int comp = INTEGER(compression)[0];
+  bool pal = LOGICAL(palette)[0];
+  int quant = INTEGER(quantize)[0];
+  int n_threads = INTEGER(threads)[0];
+  
+  PageStorePtr store = page_store_for(file);
   
   BEGIN_CPP
   if (bit8) {
     if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
       AggDevicePngNoAlpha* device = new AggDevicePngNoAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
         bgCol,
         REAL(res)[0],
         REAL(scaling)[0],
-        LOGICAL(snap)[0]
+        LOGICAL(snap)[0],
+        comp,
+        pal,
+        quant,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDevicePngNoAlpha>(device, "agg_png");
     } else {
       AggDevicePngAlpha* device = new AggDevicePngAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
         bgCol,
         REAL(res)[0],
         REAL(scaling)[0],
-        LOGICAL(snap)[0]
+        LOGICAL(snap)[0],
+        comp,
+        pal,
+        quant,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDevicePngAlpha>(device, "agg_png");
     }
   } else {
     if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
       AggDevicePng16NoAlpha* device = new AggDevicePng16NoAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
         bgCol,
         REAL(res)[0],
         REAL(scaling)[0],
-        LOGICAL(snap)[0]
+        LOGICAL(snap)[0],
+        1.0,
+        comp,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDevicePng16NoAlpha>(device, "agg_png");
     } else {
       AggDevicePng16Alpha* device = new AggDevicePng16Alpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
         bgCol,
         REAL(res)[0],
         REAL(scaling)[0],
-        LOGICAL(snap)[0]
+        LOGICAL(snap)[0],
+        1.0,
+        comp,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDevicePng16Alpha>(device, "agg_png");
     }
   }
   END_CPP
   
-  return R_NilValue;
+  return page_store_xptr(store);
 }
 
 SEXP agg_supertransparent_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, 
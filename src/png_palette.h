@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "agg_color_rgba.h"
+#include "agg_rendering_buffer.h"
+
+// Compression presets for PNG files. Non-negative values are plain zlib levels
+enum PngCompression {
+  PNG_COMPRESS_DEFAULT = -1,
+  PNG_COMPRESS_FAST = -2,
+  PNG_COMPRESS_SMALL = -3
+};
+
+/* The colour palette of a frame, for writing it as an indexed PNG. The
+ * distinct colours are counted in a single pass with a small hash table,
+ * giving up as soon as there are more than 256. If allowed, the lowest bits of
+ * each channel are then discarded one at a time and the colours counted again,
+ * so that colours that only differ slightly (e.g. in antialiased edges) share
+ * a palette entry holding their average. Works on 8bit RGB and premultiplied
+ * RGBA pixels, with palette entries in straight alpha and the entries that are
+ * not opaque placed first so the tRNS chunk can be as short as possible
+ */
+template<int N_COMP>
+class PngPalette {
+  static const int TABLE_BITS = 10;
+  static const int TABLE_SIZE = 1 << TABLE_BITS;
+
+  int shift;
+  uint32_t keys[TABLE_SIZE];
+  int16_t slots[TABLE_SIZE];
+  uint64_t sums[256][4];
+  uint32_t counts[256];
+  uint8_t order[256];
+
+public:
+  int size;
+  uint8_t red[256];
+  uint8_t green[256];
+  uint8_t blue[256];
+  uint8_t alpha[256];
+  // Number of entries that are not fully opaque
+  int n_trans;
+
+  PngPalette() : shift(0), size(0), n_trans(0) {}
+
+  // Count the colours of the frame, discarding up to max_shift bits per
+  // channel. Returns false if the frame has too many colours
+  bool build(const agg::rendering_buffer& frame, int max_shift) {
+    for (shift = 0; shift <= max_shift; ++shift) {
+      if (count(frame)) {
+        finish();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The entry of a colour given as straight RGBA, or -1 if it is not present
+  int find(uint8_t r, uint8_t g, uint8_t b, uint8_t a) const {
+    for (int i = 0; i < size; ++i) {
+      if (red[i] == r && green[i] == g && blue[i] == b && alpha[i] == a) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Convert a row of pixels to palette indices, packed at bit_depth() bits
+  // per pixel as stored in the file
+  void index_row(const uint8_t* in, uint8_t* out, int n) const {
+    int bits = bit_depth();
+    int per_byte = 8 / bits;
+    if (bits < 8) {
+      std::memset(out, 0, (n + per_byte - 1) / per_byte);
+    }
+    uint32_t last_key = ~key(in);
+    uint8_t last_index = 0;
+    for (int x = 0; x < n; ++x, in += N_COMP) {
+      uint32_t k = key(in);
+      if (k != last_key) {
+        last_key = k;
+        last_index = order[slots[lookup(k)]];
+      }
+      if (bits == 8) {
+        out[x] = last_index;
+      } else {
+        out[x / per_byte] |= last_index << (8 - bits * (x % per_byte + 1));
+      }
+    }
+  }
+
+  // The smallest PNG bit depth able to hold all indices
+  int bit_depth() const {
+    return size <= 2 ? 1 : size <= 4 ? 2 : size <= 16 ? 4 : 8;
+  }
+
+private:
+  uint32_t key(const uint8_t* p) const {
+    uint32_t a = N_COMP == 4 ? p[3] : 255;
+    return uint32_t(p[0] >> shift) | (uint32_t(p[1] >> shift) << 8) |
+      (uint32_t(p[2] >> shift) << 16) | ((a >> shift) << 24);
+  }
+  static uint32_t hash(uint32_t k) {
+    return (k * 2654435761u) >> (32 - TABLE_BITS);
+  }
+  int lookup(uint32_t k) const {
+    uint32_t i = hash(k);
+    while (slots[i] >= 0 && keys[i] != k) {
+      i = (i + 1) & (TABLE_SIZE - 1);
+    }
+    return i;
+  }
+
+  bool count(const agg::rendering_buffer& frame) {
+    std::fill(slots, slots + TABLE_SIZE, int16_t(-1));
+    std::memset(sums, 0, sizeof(sums));
+    std::memset(counts, 0, sizeof(counts));
+    size = 0;
+    int width = frame.width();
+    for (int y = 0; y < int(frame.height()); ++y) {
+      const uint8_t* p = frame.row_ptr(y);
+      uint32_t last_key = ~key(p);
+      int entry = 0;
+      for (int x = 0; x < width; ++x, p += N_COMP) {
+        uint32_t k = key(p);
+        if (k != last_key) {
+          last_key = k;
+          int i = lookup(k);
+          if (slots[i] < 0) {
+            if (size == 256) {
+              return false;
+            }
+            keys[i] = k;
+            slots[i] = size++;
+          }
+          entry = slots[i];
+        }
+        if (shift > 0) {
+          sums[entry][0] += p[0];
+          sums[entry][1] += p[1];
+          sums[entry][2] += p[2];
+          sums[entry][3] += N_COMP == 4 ? p[3] : 255;
+          counts[entry]++;
+        }
+      }
+    }
+    return true;
+  }
+
+  void finish() {
+    uint8_t pixel[4];
+    for (int i = 0; i < TABLE_SIZE; ++i) {
+      if (slots[i] < 0) {
+        continue;
+      }
+      int entry = slots[i];
+      if (shift == 0) {
+        pixel[0] = keys[i];
+        pixel[1] = keys[i] >> 8;
+        pixel[2] = keys[i] >> 16;
+        pixel[3] = keys[i] >> 24;
+      } else {
+        uint64_t n = counts[entry];
+        for (int c = 0; c < 4; ++c) {
+          pixel[c] = (sums[entry][c] + n / 2) / n;
+        }
+      }
+      red[entry] = pixel[0];
+      green[entry] = pixel[1];
+      blue[entry] = pixel[2];
+      alpha[entry] = pixel[3];
+      if (N_COMP == 4) {
+        red[entry] = agg::rgba8::demultiply(red[entry], alpha[entry]);
+        green[entry] = agg::rgba8::demultiply(green[entry], alpha[entry]);
+        blue[entry] = agg::rgba8::demultiply(blue[entry], alpha[entry]);
+      }
+    }
+
+    // Move the entries that are not opaque to the front, otherwise keeping
+    // the order of first appearance
+    n_trans = 0;
+    for (int i = 0; i < size; ++i) {
+      if (alpha[i] < 255) {
+        order[i] = n_trans++;
+      }
+    }
+    int next = n_trans;
+    for (int i = 0; i < size; ++i) {
+      if (alpha[i] == 255) {
+        order[i] = next++;
+      }
+    }
+    uint8_t tmp[4][256];
+    for (int i = 0; i < size; ++i) {
+      tmp[0][order[i]] = red[i];
+      tmp[1][order[i]] = green[i];
+      tmp[2][order[i]] = blue[i];
+      tmp[3][order[i]] = alpha[i];
+    }
+    std::memcpy(red, tmp[0], size);
+    std::memcpy(green, tmp[1], size);
+    std::memcpy(blue, tmp[2], size);
+    std::memcpy(alpha, tmp[3], size);
+  }
+};
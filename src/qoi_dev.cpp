@@ -0,0 +1,44 @@
+#include "ragg.h"
+#include "init_device.h"
+
+#include "AggDeviceQoi.h"
+
+// [[export]]
+SEXP agg_qoi_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg, 
+               SEXP res, SEXP scaling, SEXP snap) {
+  int bgCol = RGBpar(bg, 0);
+  
+  PageStorePtr store = page_store_for(file);
+  
+  BEGIN_CPP
+  if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
+    AggDeviceQoiNoAlpha* device = new AggDeviceQoiNoAlpha(
+      page_file_name(file), 
+      INTEGER(width)[0], 
+      INTEGER(height)[0], 
+      REAL(pointsize)[0], 
+      bgCol,
+      REAL(res)[0],
+      REAL(scaling)[0],
+      LOGICAL(snap)[0]
+    );
+    device->page_store = store;
+    makeDevice<AggDeviceQoiNoAlpha>(device, "agg_qoi");
+  } else {
+    AggDeviceQoiAlpha* device = new AggDeviceQoiAlpha(
+      page_file_name(file), 
+      INTEGER(width)[0], 
+      INTEGER(height)[0], 
+      REAL(pointsize)[0], 
+      bgCol,
+      REAL(res)[0],
+      REAL(scaling)[0],
+      LOGICAL(snap)[0]
+    );
+    device->page_store = store;
+    makeDevice<AggDeviceQoiAlpha>(device, "agg_qoi");
+  }
+  END_CPP
+  
+  return page_store_xptr(store);
+}
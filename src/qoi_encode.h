@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/* An encoder for the QOI ("Quite OK Image") format, see https://qoiformat.org.
+ * QOI compresses lossless images in a single pass with a handful of simple
+ * operations (runs of the previous pixel, lookups in a 64 entry table of
+ * recently seen pixels, and small differences to the previous pixel), which
+ * makes it an order of magnitude faster to write than PNG while still giving
+ * reasonable compression for plots. The image is encoded one row at a time
+ * from straight (not premultiplied) RGB or RGBA pixels, appending the output to
+ * a buffer that the caller may flush between rows. Runs are detected a block
+ * of pixels at a time without branching inside the block, which compilers can
+ * vectorise, as plots typically consist mostly of long runs of background
+ */
+class QoiEncoder {
+  static const int RUN_BLOCK = 16;
+  static const int MAX_RUN = 62;
+
+  int channels;
+  uint32_t index[64];
+  uint32_t prev;
+  int run;
+  std::vector<uint32_t> pixels;
+
+public:
+  // The largest number of bytes written for a row of n pixels
+  static size_t max_row_bytes(int n, int channels) {
+    return size_t(n) * (channels + 1) + 1;
+  }
+
+  explicit QoiEncoder(int n_channels) :
+    channels(n_channels),
+    prev(pack(0, 0, 0, 255)),
+    run(0)
+  {
+    std::memset(index, 0, sizeof(index));
+  }
+
+  void header(std::vector<unsigned char>& out, uint32_t width, uint32_t height) const {
+    const unsigned char magic[4] = {'q', 'o', 'i', 'f'};
+    out.insert(out.end(), magic, magic + 4);
+    put_be32(out, width);
+    put_be32(out, height);
+    out.push_back(channels);
+    out.push_back(0); // sRGB with linear alpha
+  }
+
+  // Encode a row of n pixels with the given number of channels
+  void encode_row(const unsigned char* in, int n, std::vector<unsigned char>& out) {
+    pixels.resize(n);
+    uint32_t* px = pixels.data();
+    if (channels == 4) {
+      for (int x = 0; x < n; ++x, in += 4) {
+        px[x] = pack(in[0], in[1], in[2], in[3]);
+      }
+    } else {
+      for (int x = 0; x < n; ++x, in += 3) {
+        px[x] = pack(in[0], in[1], in[2], 255);
+      }
+    }
+
+    size_t start = out.size();
+    out.resize(start + max_row_bytes(n, channels));
+    unsigned char* o = out.data() + start;
+
+    int x = 0;
+    while (x < n) {
+      if (px[x] == prev) {
+        int len = run_length(px + x, n - x, prev);
+        run += len;
+        x += len;
+        while (run >= MAX_RUN) {
+          *o++ = 0xc0 | (MAX_RUN - 1);
+          run -= MAX_RUN;
+        }
+        continue;
+      }
+      o = flush_run(o);
+
+      uint32_t p = px[x++];
+      int r = p & 0xff, g = (p >> 8) & 0xff, b = (p >> 16) & 0xff, a = p >> 24;
+      int h = (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+      if (index[h] == p) {
+        *o++ = h;
+      } else {
+        index[h] = p;
+        if ((p >> 24) == (prev >> 24)) {
+          signed char vr = r - int(prev & 0xff);
+          signed char vg = g - int((prev >> 8) & 0xff);
+          signed char vb = b - int((prev >> 16) & 0xff);
+          signed char vg_r = vr - vg;
+          signed char vg_b = vb - vg;
+          if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+            *o++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+          } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                     vg_b > -9 && vg_b < 8) {
+            *o++ = 0x80 | (vg + 32);
+            *o++ = (vg_r + 8) << 4 | (vg_b + 8);
+          } else {
+            *o++ = 0xfe;
+            *o++ = r;
+            *o++ = g;
+            *o++ = b;
+          }
+        } else {
+          *o++ = 0xff;
+          *o++ = r;
+          *o++ = g;
+          *o++ = b;
+          *o++ = a;
+        }
+      }
+      prev = p;
+    }
+    out.resize(o - out.data());
+  }
+
+  // Write any pending run and the end marker
+  void finish(std::vector<unsigned char>& out) {
+    out.resize(out.size() + 1);
+    unsigned char* o = flush_run(out.data() + out.size() - 1);
+    out.resize(o - out.data());
+    const unsigned char padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.insert(out.end(), padding, padding + 8);
+  }
+
+private:
+  static uint32_t pack(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+    return r | g << 8 | b << 16 | a << 24;
+  }
+  static void put_be32(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+  }
+
+  unsigned char* flush_run(unsigned char* o) {
+    if (run > 0) {
+      *o++ = 0xc0 | (run - 1);
+      run = 0;
+    }
+    return o;
+  }
+
+  // The number of pixels from the start of px equal to value. Whole blocks are
+  // compared without early exit, so the comparison can be vectorised
+  static int run_length(const uint32_t* px, int n, uint32_t value) {
+    int len = 0;
+    while (len + RUN_BLOCK <= n) {
+      uint32_t diff = 0;
+      for (int i = 0; i < RUN_BLOCK; ++i) {
+        diff |= px[len + i] ^ value;
+      }
+      if (diff != 0) {
+        break;
+      }
+      len += RUN_BLOCK;
+    }
+    while (len < n && px[len] == value) {
+      ++len;
+    }
+    return len;
+  }
+};
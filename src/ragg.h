@@ -47,41 +47,46 @@ typedef agg::pixfmt_rgba32_plain                pixfmt_r_raster;
 typedef agg::pixfmt_rgba32_pre                  pixfmt_r_capture;
 #endif
 
-// pixfmt agnosting demultiplying
-template<typename PIXFMT>
-inline void demultiply(PIXFMT* pixfmt) {
-  return;
-}
-template<>
-inline void demultiply<pixfmt_type_32>(pixfmt_type_32* pixfmt) {
-  pixfmt->demultiply();
-  return;
-}
-template<>
-inline void demultiply<pixfmt_type_64>(pixfmt_type_64* pixfmt) {
-  pixfmt->demultiply();
-  return;
-}
-
 SEXP agg_ppm_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                SEXP res, SEXP scaling, SEXP snap);
+SEXP agg_qoi_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP snap);
 SEXP agg_png_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
-               SEXP res, SEXP scaling, SEXP snap, SEXP bit);
+               SEXP res, SEXP scaling, SEXP snap, SEXP bit, SEXP compression,
+               SEXP palette, SEXP quantize, SEXP threads);
 SEXP agg_webp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                 SEXP res, SEXP scaling, SEXP snap, SEXP lossy, SEXP quality);
 SEXP agg_webp_anim_c(SEXP file, SEXP width, SEXP height, SEXP pointsize,
                      SEXP bg, SEXP res, SEXP scaling, SEXP snap, SEXP delay,
                      SEXP loop, SEXP lossy, SEXP quality);
+SEXP agg_apng_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+                SEXP res, SEXP scaling, SEXP snap, SEXP compression,
+                SEXP palette, SEXP delay, SEXP loop);
 SEXP agg_supertransparent_c(SEXP file, SEXP width, SEXP height, SEXP pointsize,
                             SEXP bg, SEXP res, SEXP scaling, SEXP snap,
                             SEXP alpha_mod);
 SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                 SEXP res, SEXP scaling, SEXP snap, SEXP bit, SEXP compression,
-                SEXP encoding);
+                SEXP encoding, SEXP tile, SEXP bigtiff, SEXP multipage,
+                SEXP threads);
 SEXP agg_jpeg_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                 SEXP res, SEXP scaling, SEXP snap, SEXP quality, SEXP smoothing,
                 SEXP method);
 SEXP agg_capture_c(SEXP name, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                    SEXP res, SEXP scaling, SEXP snap);
+SEXP agg_capture_region_c(SEXP region, SEXP changes, SEXP native);
+SEXP agg_shm_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP snap);
+SEXP agg_rawvideo_c(SEXP file, SEXP width, SEXP height, SEXP pointsize,
+                    SEXP bg, SEXP res, SEXP scaling, SEXP snap, SEXP format);
 SEXP agg_record_c(SEXP name, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
                   SEXP res, SEXP scaling, SEXP snap);
+SEXP agg_glyph_cache_info_c();
+SEXP agg_flush_cache_c();
+SEXP agg_memory_pages_c(SEXP store);
+
+extern "C" {
+int ragg_device_buffer(unsigned char* data, int width, int height, int stride,
+                       int format, double pointsize, int bg, double res,
+                       double scaling, int snap, const char* name);
+}
@@ -0,0 +1,47 @@
+#include "ragg.h"
+#include "init_device.h"
+
+#include "AggDeviceRaw.h"
+
+template<class T>
+static void make_raw_device(const char* path, SEXP width, SEXP height,
+                            SEXP pointsize, int bgCol, SEXP res, SEXP scaling,
+                            SEXP snap, int format) {
+  T* device = new T(
+    path,
+    INTEGER(width)[0],
+    INTEGER(height)[0],
+    REAL(pointsize)[0],
+    bgCol,
+    REAL(res)[0],
+    REAL(scaling)[0],
+    LOGICAL(snap)[0],
+    format
+  );
+  if (!device->is_open()) {
+    delete device;
+    Rf_error("agg could not open the given file: %s", path);
+  }
+  makeDevice<T>(device, "agg_rawvideo");
+}
+
+// [[export]]
+SEXP agg_rawvideo_c(SEXP file, SEXP width, SEXP height, SEXP pointsize,
+                    SEXP bg, SEXP res, SEXP scaling, SEXP snap, SEXP format) {
+  int bgCol = RGBpar(bg, 0);
+  int fmt = INTEGER(format)[0];
+  const char* path = Rf_translateCharUTF8((STRING_ELT(file, 0)));
+
+  BEGIN_CPP
+  if (fmt == RAW_RGBA) {
+    make_raw_device<AggDeviceRawAlpha>(path, width, height, pointsize, bgCol, res, scaling, snap, fmt);
+  } else {
+    if (R_TRANSPARENT(bgCol)) {
+      bgCol = R_TRANWHITE;
+    }
+    make_raw_device<AggDeviceRawNoAlpha>(path, width, height, pointsize, bgCol, res, scaling, snap, fmt);
+  }
+  END_CPP
+
+  return R_NilValue;
+}
@@ -1,11 +1,19 @@
 #pragma once
 
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <type_traits>
+
 #include "ragg.h"
 #include "agg_pixfmt_gray.h"
+#include "agg_pixfmt_rgba.h"
 
+#include "agg_rasterizer_scanline_aa.h"
 #include "agg_scanline_p.h"
 #include "agg_scanline_u.h"
 #include "agg_scanline_boolean_algebra.h"
+#include "agg_scanline_storage_aa.h"
 #include "util/agg_color_conv.h"
 #include "agg_image_accessors.h"
 #include "agg_span_image_filter_rgba.h"
@@ -57,3 +65,312 @@ void render_raster(agg::rendering_buffer &rbuf, unsigned w, unsigned h, Raster &
   
   delete [] buffer8;
 }
+
+// Span generator copying from a premultiplied RGBA bitmap placed at an integer
+// pixel offset. Pixels outside the bitmap are transparent
+template<class ColorType>
+class span_bitmap_rgba {
+  const agg::int8u* m_data;
+  int m_x;
+  int m_y;
+  int m_w;
+  int m_h;
+
+public:
+  span_bitmap_rgba(const agg::int8u* data, int x, int y, int w, int h) :
+    m_data(data), m_x(x), m_y(y), m_w(w), m_h(h) {}
+
+  void prepare() {}
+
+  void generate(ColorType* span, int x, int y, unsigned len) {
+    y -= m_y;
+    x -= m_x;
+    for (; len; --len, ++span, ++x) {
+      if (y < 0 || y >= m_h || x < 0 || x >= m_w) {
+        *span = ColorType::no_color();
+        continue;
+      }
+      const agg::int8u* p = m_data + (y * m_w + x) * 4;
+      *span = ColorType(agg::rgba8(p[0], p[1], p[2], p[3]));
+    }
+  }
+};
+
+// Render a premultiplied RGBA bitmap at an integer pixel offset without any
+// resampling
+template<class Render, class RasterClip, class Scanline>
+void render_bitmap(const agg::int8u* data, int x, int y, int w, int h,
+                   RasterClip &ras_clip, Scanline &sl, Render &renderer,
+                   bool clip) {
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+  agg::rasterizer_scanline_aa<> ras;
+  ras.move_to_d(x, y);
+  ras.line_to_d(x + w, y);
+  ras.line_to_d(x + w, y + h);
+  ras.line_to_d(x, y + h);
+  ras.close_polygon();
+
+  typedef span_bitmap_rgba<typename Render::color_type> span_gen_type;
+  span_gen_type sg(data, x, y, w, h);
+  agg::span_allocator<typename Render::color_type> sa;
+  agg::renderer_scanline_aa<Render, agg::span_allocator<typename Render::color_type>, span_gen_type> bitmap_renderer(renderer, sa, sg);
+  render<agg::scanline_p8>(ras, ras_clip, sl, bitmap_renderer, clip);
+}
+
+// Whether pixels are blended with the default source over operator. Custom
+// blend pixel formats may use any compositing operator
+template<class PixFmt> struct is_source_over : std::true_type {};
+template<class Blender, class RenBuf>
+struct is_source_over<agg::pixfmt_custom_blend_rgba<Blender, RenBuf> > : std::false_type {};
+
+// Merges the serialized scanlines of a run of glyph bitmaps into a single
+// scanline stream so the whole run can be rendered in one pass. Overlapping
+// coverage a and b is combined as a + b - ab. This only gives the same result
+// as blending the glyphs one after the other if they are drawn in an opaque
+// colour with source over blending and the coverage is not scaled further by
+// a mask. A clip path is applied to each glyph before merging (see
+// glyph_run_clipped). Otherwise the glyphs must be rendered one at a time
+// with glyph()
+class glyph_run_scanlines {
+  typedef agg::serialized_scanlines_adaptor_aa8 adaptor_type;
+  struct run_item {
+    adaptor_type adaptor;
+    adaptor_type::embedded_scanline sl;
+    bool pending;
+  };
+  struct later_item {
+    const std::vector<run_item>& items;
+    later_item(const std::vector<run_item>& i) : items(i) {}
+    bool operator()(size_t a, size_t b) const {
+      return items[a].sl.y() > items[b].sl.y();
+    }
+  };
+
+  struct unclipped {
+    bool row(int) { return true; }
+    unsigned apply(unsigned cover, long) { return cover; }
+  };
+
+  std::vector<run_item> m_items;
+  // Min-heap of the items with scanlines left, ordered by their current y
+  std::vector<size_t> m_queue;
+  std::vector<agg::int8u> m_row;
+  long m_min_x;
+  long m_min_y;
+  long m_max_x;
+  long m_max_y;
+
+public:
+  glyph_run_scanlines() :
+    m_min_x(0), m_min_y(0), m_max_x(0), m_max_y(0) {}
+
+  void reset() {
+    m_items.clear();
+  }
+  bool empty() const {
+    return m_items.empty();
+  }
+  size_t size() const {
+    return m_items.size();
+  }
+  // The scanlines of a single glyph of the run
+  adaptor_type& glyph(size_t i) {
+    return m_items[i].adaptor;
+  }
+
+  // The glyph data must stay alive until the run is reset
+  void add(const agg::int8u* data, unsigned size, double x, double y) {
+    run_item item;
+    item.adaptor.init(data, size, x, y);
+    item.pending = false;
+    if (item.adaptor.rewind_scanlines()) {
+      m_items.push_back(item);
+    }
+  }
+
+  long min_x() const { return m_min_x; }
+  long min_y() const { return m_min_y; }
+  long max_x() const { return m_max_x; }
+  long max_y() const { return m_max_y; }
+
+  bool rewind_scanlines() {
+    m_min_x = m_min_y = LONG_MAX;
+    m_max_x = m_max_y = LONG_MIN;
+    m_queue.clear();
+    bool any = false;
+    for (size_t i = 0; i < m_items.size(); ++i) {
+      run_item& item = m_items[i];
+      item.adaptor.rewind_scanlines();
+      item.pending = item.adaptor.sweep_scanline(item.sl);
+      if (!item.pending) continue;
+      any = true;
+      m_queue.push_back(i);
+      m_min_x = std::min(m_min_x, item.adaptor.min_x());
+      m_min_y = std::min(m_min_y, item.adaptor.min_y());
+      m_max_x = std::max(m_max_x, item.adaptor.max_x());
+      m_max_y = std::max(m_max_y, item.adaptor.max_y());
+    }
+    if (any) {
+      m_row.assign(m_max_x - m_min_x + 1, 0);
+      std::make_heap(m_queue.begin(), m_queue.end(), later_item(m_items));
+    }
+    return any;
+  }
+
+  template<class Scanline> bool sweep_scanline(Scanline& sl) {
+    unclipped full;
+    return sweep_scanline(sl, full);
+  }
+
+  // As above, but the coverage of every glyph is first scaled by clip, which
+  // is told about each row with row(y) and returns false if nothing is
+  // visible on it. apply(cover, i) gives the clipped cover of the pixel at
+  // min_x() + i
+  template<class Scanline, class Clip> bool sweep_scanline(Scanline& sl, Clip& clip) {
+    later_item later(m_items);
+    for (;;) {
+      if (m_queue.empty()) return false;
+      int y = m_items[m_queue.front()].sl.y();
+      bool visible = clip.row(y);
+
+      long lo = LONG_MAX;
+      long hi = LONG_MIN;
+      while (!m_queue.empty() && m_items[m_queue.front()].sl.y() == y) {
+        std::pop_heap(m_queue.begin(), m_queue.end(), later);
+        run_item& item = m_items[m_queue.back()];
+        // Advancing the iterator reads the next span, so it mustn't be moved
+        // past the last one
+        adaptor_type::embedded_scanline::const_iterator span = item.sl.begin();
+        for (unsigned n = visible ? item.sl.num_spans() : 0; n > 0; ++span) {
+          int len = span->len < 0 ? -span->len : span->len;
+          long start = span->x - m_min_x;
+          lo = std::min(lo, start);
+          hi = std::max(hi, start + len - 1);
+          for (int k = 0; k < len; ++k) {
+            unsigned cover = clip.apply(span->len < 0 ? span->covers[0] : span->covers[k], start + k);
+            unsigned cur = m_row[start + k];
+            m_row[start + k] = agg::int8u(cur + cover - (cur * cover + 127) / 255);
+          }
+          if (--n == 0) break;
+        }
+        item.pending = item.adaptor.sweep_scanline(item.sl);
+        if (item.pending) {
+          std::push_heap(m_queue.begin(), m_queue.end(), later);
+        } else {
+          m_queue.pop_back();
+        }
+      }
+
+      sl.reset_spans();
+      long x = lo;
+      while (x <= hi) {
+        if (m_row[x] == 0) {
+          ++x;
+          continue;
+        }
+        long start = x;
+        while (x <= hi && m_row[x] != 0) ++x;
+        sl.add_cells(int(start + m_min_x), unsigned(x - start), &m_row[start]);
+      }
+      if (lo <= hi) {
+        std::fill(m_row.begin() + lo, m_row.begin() + hi + 1, 0);
+      }
+      if (sl.num_spans()) {
+        sl.finalize(y);
+        return true;
+      }
+    }
+  }
+};
+
+/* A glyph run intersected with a clip path, rendering the same pixels as
+ * intersecting every glyph with sbool_intersect_shapes_aa() and blending them
+ * one after the other. The clip rasterizer is swept once for the whole run,
+ * alongside the merged glyph scanlines, and each glyph's coverage a is scaled
+ * by the clip coverage c before it is merged, i.e. m += ac - mac, with ac
+ * rounded as in sbool_intersect_spans_aa(). Glyph scanlines are swept into
+ * scanline_u8 there and are therefore never solid
+ */
+template<class RasterClip>
+class glyph_run_clipped {
+  glyph_run_scanlines& m_run;
+  RasterClip& m_ras_clip;
+  agg::scanline_p8 m_sl_clip;
+  bool m_pending;
+  std::vector<agg::int8u> m_row;
+  // Whether the clip cover comes from a fully covered solid span, in which
+  // case sbool_intersect_spans_aa() passes the glyph cover on unchanged
+  std::vector<agg::int8u> m_full;
+  long m_lo;
+  long m_hi;
+
+public:
+  glyph_run_clipped(glyph_run_scanlines& run, RasterClip& ras_clip) :
+    m_run(run), m_ras_clip(ras_clip), m_pending(false), m_lo(0), m_hi(-1) {}
+
+  long min_x() const { return m_run.min_x(); }
+  long min_y() const { return m_run.min_y(); }
+  long max_x() const { return m_run.max_x(); }
+  long max_y() const { return m_run.max_y(); }
+
+  bool rewind_scanlines() {
+    if (!m_run.rewind_scanlines() || !m_ras_clip.rewind_scanlines()) {
+      return false;
+    }
+    m_sl_clip.reset(m_ras_clip.min_x(), m_ras_clip.max_x());
+    m_pending = m_ras_clip.sweep_scanline(m_sl_clip);
+    m_row.assign(m_run.max_x() - m_run.min_x() + 1, 0);
+    m_full.assign(m_row.size(), 0);
+    m_lo = 0;
+    m_hi = -1;
+    return m_pending;
+  }
+
+  template<class Scanline> bool sweep_scanline(Scanline& sl) {
+    return m_run.sweep_scanline(sl, *this);
+  }
+
+  // Load the clip coverage of row y, relative to the start of the run
+  bool row(int y) {
+    if (m_lo <= m_hi) {
+      std::fill(m_row.begin() + m_lo, m_row.begin() + m_hi + 1, 0);
+      std::fill(m_full.begin() + m_lo, m_full.begin() + m_hi + 1, 0);
+    }
+    m_lo = LONG_MAX;
+    m_hi = LONG_MIN;
+    while (m_pending && m_sl_clip.y() < y) {
+      m_pending = m_ras_clip.sweep_scanline(m_sl_clip);
+    }
+    if (!m_pending || m_sl_clip.y() != y) {
+      return false;
+    }
+    long offset = m_run.min_x();
+    long last = long(m_row.size()) - 1;
+    agg::scanline_p8::const_iterator span = m_sl_clip.begin();
+    for (unsigned n = m_sl_clip.num_spans(); n > 0; --n, ++span) {
+      int len = span->len < 0 ? -span->len : span->len;
+      long start = std::max(long(span->x) - offset, 0L);
+      long end = std::min(long(span->x) + len - 1 - offset, last);
+      bool full = span->len < 0 && span->covers[0] == 255;
+      for (long i = start; i <= end; ++i) {
+        m_row[i] = span->len < 0 ? span->covers[0] : span->covers[i + offset - span->x];
+        m_full[i] = full;
+      }
+      if (start <= end) {
+        m_lo = std::min(m_lo, start);
+        m_hi = std::max(m_hi, end);
+      }
+    }
+    return m_lo <= m_hi;
+  }
+
+  unsigned apply(unsigned cover, long i) {
+    if (m_full[i]) {
+      return cover;
+    }
+    unsigned c = cover * m_row[i];
+    return c == 255 * 255 ? 255 : c >> 8;
+  }
+};
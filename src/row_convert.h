@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/* Conversion of single rows of premultiplied pixels into the straight alpha
+ * layouts expected by image encoders. Encoders are fed one converted row at a
+ * time from a small scratch buffer, so the frame buffer itself stays untouched
+ * and no extra pass over the full frame is needed. The loops are kept free of
+ * branches and divisions so the compiler can vectorise them. The results are
+ * identical to agg's demultiply(), i.e. (c * max + a / 2) / a clamped to max
+ */
+
+// Reciprocals of all 8bit alpha values, scaled by 2^24. For all x < 2^16,
+// (x * scale) >> 24 equals x / a. The table is built once in a thread safe
+// static initialiser as rows may be converted on several threads
+struct DemultiplyScales8 {
+  uint32_t scales[256];
+  DemultiplyScales8() {
+    scales[0] = 0;
+    for (uint32_t a = 1; a < 256; ++a) {
+      scales[a] = ((uint32_t(1) << 24) + a - 1) / a;
+    }
+  }
+};
+inline const uint32_t* demultiply_scales8() {
+  static const DemultiplyScales8 table;
+  return table.scales;
+}
+
+inline uint8_t demultiply_value8(uint32_t c, uint32_t a, uint32_t scale) {
+  uint64_t x = c * 255u + (a >> 1);
+  return uint8_t(std::min(uint64_t(255), (x * scale) >> 24));
+}
+
+// RGBA (8bit) to straight RGBA
+inline void demultiply_row_rgba8(const uint8_t* in, uint8_t* out, int n) {
+  const uint32_t* scales = demultiply_scales8();
+  for (int x = 0; x < n; ++x) {
+    uint32_t a = in[4 * x + 3];
+    uint32_t scale = scales[a];
+    out[4 * x] = demultiply_value8(in[4 * x], a, scale);
+    out[4 * x + 1] = demultiply_value8(in[4 * x + 1], a, scale);
+    out[4 * x + 2] = demultiply_value8(in[4 * x + 2], a, scale);
+    out[4 * x + 3] = a;
+  }
+}
+
+// RGBA (8bit) to straight ARGB packed into native 32bit integers
+inline void demultiply_row_argb8(const uint8_t* in, uint32_t* out, int n) {
+  const uint32_t* scales = demultiply_scales8();
+  for (int x = 0; x < n; ++x) {
+    uint32_t a = in[4 * x + 3];
+    uint32_t scale = scales[a];
+    out[x] = (a << 24) |
+      (uint32_t(demultiply_value8(in[4 * x], a, scale)) << 16) |
+      (uint32_t(demultiply_value8(in[4 * x + 1], a, scale)) << 8) |
+      uint32_t(demultiply_value8(in[4 * x + 2], a, scale));
+  }
+}
+
+// RGB (8bit) to opaque ARGB packed into native 32bit integers
+inline void rgb_row_argb8(const uint8_t* in, uint32_t* out, int n) {
+  for (int x = 0; x < n; ++x) {
+    out[x] = 0xFF000000u | (uint32_t(in[3 * x]) << 16) |
+      (uint32_t(in[3 * x + 1]) << 8) | uint32_t(in[3 * x + 2]);
+  }
+}
+
+// RGBA (16bit, native byte order) to straight RGBA in big endian byte order.
+// The quotient is exact in double precision. As in agg, colours with a zero
+// alpha become zero
+inline void demultiply_row_rgba16_be(const uint16_t* in, uint8_t* out, int n) {
+  for (int x = 0; x < n; ++x) {
+    uint32_t a = in[4 * x + 3];
+    double div = double(std::max(a, uint32_t(1)));
+    double half = double(a >> 1);
+    double mask = a == 0 ? 0.0 : 1.0;
+    for (int i = 0; i < 3; ++i) {
+      double c = double(in[4 * x + i]) * 65535.0 * mask + half;
+      uint32_t v = uint32_t(std::min(65535.0, c / div));
+      out[8 * x + 2 * i] = uint8_t(v >> 8);
+      out[8 * x + 2 * i + 1] = uint8_t(v);
+    }
+    out[8 * x + 6] = uint8_t(a >> 8);
+    out[8 * x + 7] = uint8_t(a);
+  }
+}
+
+// 16bit samples in native byte order to big endian byte order
+inline void bigend_row16(const uint16_t* in, uint8_t* out, int n) {
+  for (int x = 0; x < n; ++x) {
+    out[2 * x] = uint8_t(in[x] >> 8);
+    out[2 * x + 1] = uint8_t(in[x]);
+  }
+}
@@ -0,0 +1,31 @@
+#include "ragg.h"
+#include "init_device.h"
+
+#include "AggDeviceShm.h"
+
+// [[export]]
+SEXP agg_shm_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
+               SEXP res, SEXP scaling, SEXP snap) {
+  int bgCol = RGBpar(bg, 0);
+  const char* path = Rf_translateCharUTF8((STRING_ELT(file, 0)));
+
+  BEGIN_CPP
+  AggDeviceShmAlpha* device = new AggDeviceShmAlpha(
+    path,
+    INTEGER(width)[0],
+    INTEGER(height)[0],
+    REAL(pointsize)[0],
+    bgCol,
+    REAL(res)[0],
+    REAL(scaling)[0],
+    LOGICAL(snap)[0]
+  );
+  if (!device->is_open()) {
+    delete device;
+    Rf_error("agg could not map the given file: %s", path);
+  }
+  makeDevice<AggDeviceShmAlpha>(device, "agg_shm");
+  END_CPP
+
+  return R_NilValue;
+}
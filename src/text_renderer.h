@@ -1,13 +1,24 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <systemfonts.h>
 #include <textshaping.h>
 
 
 #include "ragg.h"
 #include "rendering.h"
+#include "glyph_atlas.h"
+#include "metric_cache.h"
+#include "glyph_workers.h"
+#include "disk_cache.h"
 
 #include "agg_font_freetype.h"
 #include "agg_span_interpolator_linear.h"
@@ -19,7 +30,6 @@
 #include "util/agg_color_conv.h"
 
 typedef agg::font_engine_freetype_int32 font_engine_type;
-typedef agg::font_cache_manager<font_engine_type> font_manager_type;
 
 /*
  Basic UTF-8 manipulation routines
@@ -199,26 +209,99 @@ public:
   }
 };
 
+/* A single FreeType engine is shared by all devices. It keeps a pool of open
+ * faces and the glyphs it renders are stored in the shared glyph atlas. The
+ * font it currently has loaded is tracked here rather than in each device, so
+ * switching between devices only loads a font if it actually differs
+ */
+struct FontEngineState {
+  font_engine_type engine;
+  FontSettings font;
+  agg::glyph_rendering gren;
+  unsigned int face;
+  bool loaded;
+
+  FontEngineState() :
+    gren(agg::glyph_ren_native_mono),
+    face(0),
+    loaded(false)
+  {
+    memset(&font, 0, sizeof(FontSettings));
+  }
+};
+
+inline FontEngineState& get_font_engine_state() {
+  static FontEngineState state;
+  return state;
+}
+
+inline GlyphWorkers<font_engine_type>& get_glyph_workers() {
+  static GlyphWorkers<font_engine_type> workers;
+  return workers;
+}
+
+// A string shaped with a given font and size
+struct ShapedText {
+  double width;
+  std::vector<textshaping::Point> loc;
+  std::vector<uint32_t> id;
+  std::vector<int> cluster;
+  std::vector<unsigned int> font;
+  std::vector<FontSettings> fallback;
+  std::vector<double> scaling;
+};
+
 template<typename PIXFMT>
 class TextRenderer {
   FontSettings last_font;
   agg::glyph_rendering last_gren;
-  std::vector<textshaping::Point> loc_buffer;
-  std::vector<uint32_t> id_buffer;
-  std::vector<int> cluster_buffer;
-  std::vector<unsigned int> font_buffer;
-  std::vector<FontSettings> fallback_buffer;
-  std::vector<double> scaling_buffer;
+  ShapedText shape_buffer;
+  std::vector<double> x_buffer;
+  std::vector<double> y_buffer;
+  std::vector<GlyphJob> job_buffer;
+  std::unordered_set<GlyphKey, GlyphKeyHash> job_keys;
   double current_font_height;
   double current_font_size;
   bool no_bearings;
+  unsigned int current_face;
+  int current_rot;
+  bool free_rotation;
+  agg::trans_affine current_mtx;
+  font_engine_type::path_adaptor_type path_adaptor;
+  glyph_run_scanlines glyph_run;
 
 public:
-  TextRenderer() {
+  TextRenderer() :
+    current_face(0),
+    current_rot(0),
+    free_rotation(false)
+  {
     last_gren = agg::glyph_ren_native_mono;
     get_engine().hinting(true);
     get_engine().flip_y(true);
     get_engine().gamma(agg::gamma_power(1.6));
+
+    SEXP cache_size = Rf_GetOption1(Rf_install("ragg.glyph_cache_size"));
+    if (Rf_isNumeric(cache_size) && Rf_length(cache_size) == 1) {
+      double budget = Rf_asReal(cache_size);
+      if (budget >= 0) {
+        get_glyph_atlas().budget((size_t) budget);
+      }
+    }
+    SEXP threads = Rf_GetOption1(Rf_install("ragg.glyph_threads"));
+    if (Rf_isNumeric(threads) && Rf_length(threads) == 1) {
+      int n_threads = Rf_asInteger(threads);
+      if (n_threads > 0) {
+        get_glyph_workers().threads(n_threads);
+      }
+    }
+    SEXP cache_file = Rf_GetOption1(Rf_install("ragg.cache_file"));
+    if (Rf_isString(cache_file) && Rf_length(cache_file) == 1 &&
+        STRING_ELT(cache_file, 0) != NA_STRING) {
+      get_disk_cache().open(R_ExpandFileName(Rf_translateChar(STRING_ELT(cache_file, 0))));
+    } else {
+      get_disk_cache().open("");
+    }
   }
 
   bool load_font(agg::glyph_rendering gren, const char *family, int face,
@@ -227,6 +310,11 @@ public:
                                       face == 2 || face == 4,
                                       face == 3 || face == 4,
                                       face == 5);
+    return load_font(gren, font, family, size, id);
+  }
+
+  bool load_font(agg::glyph_rendering gren, const FontSettings& font,
+                 const char *family, double size, unsigned int id) {
     current_font_size = size;
     if (!load_font_from_file(font, gren, size, id)) {
       Rf_warning("Unable to load font: %s", family);
@@ -246,24 +334,84 @@ public:
 
   bool load_font_from_file(FontSettings font, agg::glyph_rendering gren, double size,
                            unsigned int id) {
-    if (id != get_engine().id() ||
-        !(gren == last_gren &&
-        font.index == last_font.index &&
-        strncmp(font.file, last_font.file, PATH_MAX) == 0)) {
+    FontEngineState& state = get_font_engine_state();
+    if (!(state.loaded &&
+        gren == state.gren &&
+        font.index == state.font.index &&
+        strncmp(font.file, state.font.file, PATH_MAX) == 0)) {
       if (!get_engine().load_font(font.file, font.index, gren)) {
+        state.loaded = false;
         return false;
       }
 
-      last_gren = gren;
+      state.loaded = true;
+      state.font = font;
+      state.gren = gren;
+      state.face = get_glyph_atlas().face_id(font.file, font.index);
       get_engine().height(size);
       get_engine().id(id);
     } else if (size != get_engine().height()) {
       get_engine().height(size);
     }
+    current_face = state.face;
+    last_gren = gren;
     last_font = font;
     return true;
   }
 
+  // Width of a string in the given font. Widths are cached so repeated
+  // measurements don't require the font to be loaded
+  bool string_width(const char* string, const char *family, int face,
+                    double size, unsigned int id, double &width) {
+    FontSettings font = get_font_file(family,
+                                      face == 2 || face == 4,
+                                      face == 3 || face == 4,
+                                      face == 5);
+    StringWidthKey key = {
+      get_glyph_atlas().face_id(font.file, font.index),
+      font_features(font),
+      size,
+      string
+    };
+    if (get_metric_cache().strings.get(key, width)) {
+      return true;
+    }
+    if (!load_font(agg::glyph_ren_agg_gray8, font, family, size, id)) {
+      return false;
+    }
+    width = get_text_width(string);
+    get_metric_cache().strings.add(key, width);
+    return true;
+  }
+
+  // Metrics of a single character in the given font, cached like string_width()
+  bool char_metric(int c, const char *family, int face, double size,
+                   unsigned int id, double *ascent, double *descent,
+                   double *width) {
+    FontSettings font = get_font_file(family,
+                                      face == 2 || face == 4,
+                                      face == 3 || face == 4,
+                                      face == 5);
+    CharMetricKey key = {
+      get_glyph_atlas().face_id(font.file, font.index),
+      font_features(font),
+      size,
+      c
+    };
+    CharMetric metric;
+    if (!get_metric_cache().chars.get(key, metric)) {
+      if (!load_font(agg::glyph_ren_agg_gray8, font, family, size, id)) {
+        return false;
+      }
+      get_char_metric(c, &metric.ascent, &metric.descent, &metric.width);
+      get_metric_cache().chars.add(key, metric);
+    }
+    *ascent = metric.ascent;
+    *descent = metric.descent;
+    *width = metric.width;
+    return true;
+  }
+
   double get_text_width(const char* string) {
     double width = 0.0;
     int error = textshaping::string_width(
@@ -284,14 +432,20 @@ public:
     static UTF_UCS converter;
     unsigned index = get_engine().get_glyph_index(c);
     if (index == 0) {
-      int n_chars = 0;
-      uint32_t cc = c;
-      const char *utf_c = converter.convert_to_utf(&cc, 1, n_chars);
-      FontSettings fallback = get_fallback(utf_c, last_font.file, last_font.index);
+      FallbackKey key = {current_face, c};
+      FontSettings fallback;
+      if (!get_metric_cache().fallbacks.get(key, fallback)) {
+        int n_chars = 0;
+        uint32_t cc = c;
+        const char *utf_c = converter.convert_to_utf(&cc, 1, n_chars);
+        fallback = get_fallback(utf_c, last_font.file, last_font.index);
+        get_metric_cache().fallbacks.add(key, fallback);
+      }
       load_font_from_file(fallback, last_gren, get_engine().height(), get_engine().id());
       index = get_engine().get_glyph_index(c);
     }
-    const agg::glyph_cache* glyph = get_manager().glyph(index);
+    GlyphMetrics metrics;
+    const GlyphMetrics* glyph = get_glyph_metrics(index, metrics) ? &metrics : NULL;
 
     // This might also be relevant to non-colour fonts that are unscalable
     double h = get_engine().height();
@@ -299,7 +453,7 @@ public:
 
     // Only use 77 glyph if found and not colour font
     // Last point is to guard against wrong line-heights based in M char in emoji fonts
-    if (glyph && !(c == 77 && (index == 0 || glyph->data_type == agg::glyph_data_color))) {
+    if (glyph && !(c == 77 && (index == 0 || glyph->colour))) {
       *ascent = mod * (double) -glyph->bounds.y1;
       *descent = mod * (double) glyph->bounds.y2;
 
@@ -307,7 +461,7 @@ public:
 
 #if defined(__APPLE__)
       // Apple emojis have no descender
-      if (glyph->data_type == agg::glyph_data_color && strcmp("Apple Color Emoji", get_engine().family()) == 0) {
+      if (glyph->colour && strcmp("Apple Color Emoji", get_engine().family()) == 0) {
         double y_shift = double(glyph->bounds.y1 - glyph->bounds.y2) * 0.1;
         *descent += y_shift;
         *ascent += y_shift;
@@ -322,68 +476,144 @@ public:
     }
   }
 
-  template<typename TARGET, typename renderer_solid, typename renderer, typename raster, typename scanline>
-  void plot_text(double x, double y, const char *string, double rot, double hadj,
-                 renderer_solid &ren_solid, renderer &ren, scanline &sl, unsigned int id,
-                 raster &ras_clip, bool clip, agg::path_storage* recording_clip) {
-    agg::rasterizer_scanline_aa<> ras;
-    agg::conv_curve<font_manager_type::path_adaptor_type> curves(get_manager().path_adaptor());
-    curves.approximation_scale(2.0);
-
-    double width = get_text_width(string);
+  // Shape a string with the current font. Returns false if there is nothing to
+  // draw
+  bool shape_text(const char* string, ShapedText& text) {
+    text.width = get_text_width(string);
 
-    if (width == 0.0) {
-      return;
+    if (text.width == 0.0) {
+      return false;
     }
 
     int expected_max = strlen(string) * 16;
     if (expected_max == 0) {
-      return;
+      return false;
     }
 
-    loc_buffer.resize(expected_max);
-    id_buffer.resize(expected_max);
-    cluster_buffer.resize(expected_max);
-    font_buffer.resize(expected_max);
-    fallback_buffer.resize(expected_max);
-    scaling_buffer.resize(expected_max);
+    text.loc.reserve(expected_max);
+    text.id.reserve(expected_max);
+    text.cluster.reserve(expected_max);
+    text.font.reserve(expected_max);
+    text.fallback.reserve(expected_max);
+    text.scaling.reserve(expected_max);
 
     int err = textshaping::string_shape(
       string,
       last_font,
       current_font_size,
       72.0,
-      loc_buffer,
-      id_buffer,
-      cluster_buffer,
-      font_buffer,
-      fallback_buffer,
-      scaling_buffer
+      text.loc,
+      text.id,
+      text.cluster,
+      text.font,
+      text.fallback,
+      text.scaling
     );
 
     if (err != 0) {
       Rf_warning("textshaping failed to shape the string");
-      return;
+      return false;
     }
 
-    int n_glyphs = loc_buffer.size();
+    return text.loc.size() != 0;
+  }
 
-    if (n_glyphs == 0) {
+  template<typename TARGET, typename renderer_solid, typename renderer, typename raster, typename scanline>
+  void plot_text(double x, double y, const char *string, double rot, double hadj,
+                 renderer_solid &ren_solid, renderer &ren, scanline &sl, unsigned int id,
+                 raster &ras_clip, bool clip, agg::path_storage* recording_clip) {
+    if (!shape_text(string, shape_buffer)) {
       return;
     }
 
+    GlyphAtlasHold hold(get_glyph_atlas());
+    plot_shaped<TARGET>(x, y, shape_buffer, rot, hadj, ren_solid, ren, sl, id,
+                        ras_clip, clip, recording_clip);
+    render_glyph_run(ras_clip, sl, ren_solid, clip);
+  }
+
+  /* Draw n strings in the current font. Identical strings are only shaped
+   * once. set_colour(col) is called to change the colour of the renderers when
+   * it differs from the previous string. rot and hadj may be NULL in which case
+   * they are taken to be 0
+   */
+  template<typename TARGET, typename renderer_solid, typename renderer, typename raster, typename scanline, typename COLOUR>
+  void plot_text_bulk(int n, const char** strings, const double* x,
+                      const double* y, const double* rot, const double* hadj,
+                      const int* col, COLOUR set_colour,
+                      renderer_solid &ren_solid, renderer &ren, scanline &sl,
+                      unsigned int id, raster &ras_clip, bool clip,
+                      agg::path_storage* recording_clip) {
+    std::unordered_map<std::string, int> lookup;
+    std::vector<ShapedText> shaped;
+    std::vector<int> text_index(n, -1);
+    for (int i = 0; i < n; ++i) {
+      if (strings[i] == NULL) {
+        continue;
+      }
+      auto it = lookup.find(strings[i]);
+      if (it != lookup.end()) {
+        text_index[i] = it->second;
+        continue;
+      }
+      shaped.emplace_back();
+      if (shape_text(strings[i], shaped.back())) {
+        text_index[i] = int(shaped.size()) - 1;
+      } else {
+        shaped.pop_back();
+      }
+      lookup[strings[i]] = text_index[i];
+    }
+
+    int last_col = 0;
+    bool first = true;
+    for (int i = 0; i < n; ++i) {
+      if (text_index[i] < 0) {
+        continue;
+      }
+      if (first || col[i] != last_col) {
+        set_colour(col[i]);
+        last_col = col[i];
+        first = false;
+      }
+      // Each string is rendered on its own so overlapping strings blend as if
+      // they were drawn one by one. The atlas is only held for one string so
+      // it can evict glyphs between strings and stay within its budget
+      GlyphAtlasHold hold(get_glyph_atlas());
+      plot_shaped<TARGET>(x[i], y[i], shaped[text_index[i]],
+                          rot == NULL ? 0.0 : rot[i],
+                          hadj == NULL ? 0.0 : hadj[i], ren_solid, ren, sl, id,
+                          ras_clip, clip, recording_clip);
+      render_glyph_run(ras_clip, sl, ren_solid, clip);
+    }
+  }
+
+  // Draw shaped text. Bitmap glyphs are added to the glyph run which the
+  // caller must render, and the caller must hold the glyph atlas until then
+  template<typename TARGET, typename renderer_solid, typename renderer, typename raster, typename scanline>
+  void plot_shaped(double x, double y, const ShapedText& text, double rot,
+                   double hadj, renderer_solid &ren_solid, renderer &ren,
+                   scanline &sl, unsigned int id, raster &ras_clip, bool clip,
+                   agg::path_storage* recording_clip) {
+    agg::rasterizer_scanline_aa<> ras;
+    agg::conv_curve<font_engine_type::path_adaptor_type> curves(path_adaptor);
+    curves.approximation_scale(2.0);
+
+    int n_glyphs = text.loc.size();
+
+    x_buffer.resize(n_glyphs);
+    y_buffer.resize(n_glyphs);
+
+    set_rotation(rot);
     if (rot != 0) {
       rot = agg::deg2rad(-rot);
-      agg::trans_affine mtx;
-      mtx *= agg::trans_affine_rotation(rot);
-      get_engine().transform(mtx);
     }
 
     double cos_rot = cos(rot);
     double sin_rot = sin(rot);
 
-    x -= (width * hadj) * cos_rot;
-    y -= (width * hadj) * sin_rot;
+    x -= (text.width * hadj) * cos_rot;
+    y -= (text.width * hadj) * sin_rot;
 
     // Snap to pixel grid for vertical or horizontal text
     if (fmod(rot, 180) < 1e-6) {
@@ -393,25 +623,32 @@ public:
     }
     int text_run_start = 0;
     for (int j = 1; j <= n_glyphs; ++j) {
-      if (j == n_glyphs || font_buffer[j] != font_buffer[j - 1]) {
-        if (fallback_buffer.size() == 0 || // To guard against old textshaping version/solaris mock
-            load_font_from_file(fallback_buffer[font_buffer[text_run_start]], last_gren, current_font_size, id)) {
+      if (j == n_glyphs || text.font[j] != text.font[j - 1]) {
+        if (text.fallback.size() == 0 || // To guard against old textshaping version/solaris mock
+            load_font_from_file(text.fallback[text.font[text_run_start]], last_gren, current_font_size, id)) {
+          for (int i = text_run_start; i < j; ++i) {
+            x_buffer[i] = x + text.loc[i].x * cos_rot + text.loc[i].y * sin_rot;
+            y_buffer[i] = y + text.loc[i].y * cos_rot + text.loc[i].x * sin_rot;
+          }
+          prefetch_glyphs(text.id.data() + text_run_start,
+                          x_buffer.data() + text_run_start,
+                          y_buffer.data() + text_run_start,
+                          j - text_run_start);
           for (int i = text_run_start; i < j; ++i) {
-            const agg::glyph_cache* glyph = get_manager().glyph(id_buffer[i]);
+            double x_glyph = x_buffer[i];
+            double y_glyph = y_buffer[i];
+            const agg::glyph_cache* glyph = get_glyph(text.id[i], x_glyph, y_glyph);
             if (glyph) {
-              double x_offset = loc_buffer[i].x * cos_rot + loc_buffer[i].y * sin_rot;
-              double y_offset = loc_buffer[i].y * cos_rot + loc_buffer[i].x * sin_rot;
-              get_manager().init_embedded_adaptors(glyph, x + x_offset, y + y_offset);
+              init_adaptors(glyph, x_glyph, y_glyph);
+              if (glyph->data_type == agg::glyph_data_gray8) {
+                glyph_run.add(glyph->data, glyph->data_size, x_glyph, y_glyph);
+                continue;
+              }
+              render_glyph_run(ras_clip, sl, ren_solid, clip);
               switch(glyph->data_type) {
               default: break;
-              case agg::glyph_data_gray8:
-                render<agg::scanline_u8>(get_manager().gray8_adaptor(), ras_clip,
-                                         sl, ren_solid,
-                                         clip);
-                break;
-
               case agg::glyph_data_color:
-                renderColourGlyph<TARGET>(glyph, x + x_offset, y + y_offset, rot, ren, sl, scaling_buffer[font_buffer[text_run_start]], ras_clip, clip);
+                renderColourGlyph<TARGET>(glyph, x_buffer[i], y_buffer[i], rot, ren, sl, text.scaling[text.font[text_run_start]], ras_clip, clip);
                 break;
 
               case agg::glyph_data_outline:
@@ -431,11 +668,9 @@ public:
       }
     }
 
-    if (rot != 0) {
-      get_engine().transform(agg::trans_affine());
-    }
-    if (fallback_buffer.size() > 1) {
-      load_font_from_file(fallback_buffer[0], last_gren, current_font_size, id);
+    set_rotation(0);
+    if (text.fallback.size() > 1) {
+      load_font_from_file(text.fallback[0], last_gren, current_font_size, id);
     }
   }
 
@@ -445,28 +680,32 @@ public:
                    raster &ras_clip, bool clip, agg::path_storage* recording_clip) {
 
     agg::rasterizer_scanline_aa<> ras;
-    agg::conv_curve<font_manager_type::path_adaptor_type> curves(get_manager().path_adaptor());
+    agg::conv_curve<font_engine_type::path_adaptor_type> curves(path_adaptor);
     curves.approximation_scale(2.0);
 
     int i;
 
+    GlyphAtlasHold hold(get_glyph_atlas());
+    set_rotation(rot);
     if (rot != 0) {
       rot = agg::deg2rad(-rot);
-      agg::trans_affine mtx;
-      mtx *= agg::trans_affine_rotation(rot);
-      get_engine().transform(mtx);
     }
 
+    prefetch_glyphs(glyphs, x, y, n);
+
     for (i = 0; i < n; i++) {
-      const agg::glyph_cache* glyph = get_manager().glyph(glyphs[i]);
+      double x_glyph = x[i];
+      double y_glyph = y[i];
+      const agg::glyph_cache* glyph = get_glyph(glyphs[i], x_glyph, y_glyph);
       if (glyph) {
-        get_manager().init_embedded_adaptors(glyph, x[i], y[i]);
+        init_adaptors(glyph, x_glyph, y_glyph);
+        if (glyph->data_type == agg::glyph_data_gray8) {
+          glyph_run.add(glyph->data, glyph->data_size, x_glyph, y_glyph);
+          continue;
+        }
+        render_glyph_run(ras_clip, sl, ren_solid, clip);
         switch(glyph->data_type) {
         default: break;
-        case agg::glyph_data_gray8:
-          render<agg::scanline_u8>(get_manager().gray8_adaptor(), ras_clip, sl, ren_solid, clip);
-          break;
-
         case agg::glyph_data_color:
           renderColourGlyph<TARGET>(glyph, x[i], y[i], rot, ren, sl, get_engine().scaling(), ras_clip, clip);
           break;
@@ -483,20 +722,178 @@ public:
         }
       }
     }
-    if (rot != 0) {
-      get_engine().transform(agg::trans_affine());
-    }
+    render_glyph_run(ras_clip, sl, ren_solid, clip);
+    set_rotation(0);
   }
 
 private:
   inline font_engine_type& get_engine() {
-    static font_engine_type engine;
-    return engine;
+    return get_font_engine_state().engine;
   }
 
-  inline font_manager_type& get_manager() {
-    static font_manager_type manager(get_engine());
-    return manager;
+  // Set the rotation (in degrees) subsequent glyphs are rendered with. The
+  // angle is quantized to 1/64 of a degree so rotated glyphs can be cached
+  void set_rotation(double rot) {
+    current_rot = std::lround(rot * 64.0);
+    free_rotation = current_rot % (90 * 64) != 0;
+    current_mtx.reset();
+    if (current_rot != 0) {
+      current_mtx *= agg::trans_affine_rotation(agg::deg2rad(-current_rot / 64.0));
+    }
+  }
+
+  // Subpixel bin of a coordinate. The coordinate is moved to the pixel the
+  // binned bitmap should be placed at
+  static int subpixel_bin(double &pos) {
+    double pixel = std::floor(pos);
+    int bin = int((pos - pixel) * GLYPH_SUBPIXEL_BINS + 0.5);
+    if (bin == GLYPH_SUBPIXEL_BINS) {
+      pixel += 1.0;
+      bin = 0;
+    }
+    pos = pixel;
+    return bin;
+  }
+
+  // Fetch a glyph from the atlas. If the glyph is rasterized by AGG it is
+  // rendered at the closest subpixel offset and x (and y for text that isn't
+  // axis-aligned) is moved to the pixel position the bitmap should be placed at
+  const agg::glyph_cache* get_glyph(unsigned int index, double &x, double &y) {
+    agg::trans_affine mtx;
+    GlyphKey key = glyph_key(index, x, y, mtx);
+    return get_glyph_atlas().glyph(get_engine(), key, mtx);
+  }
+
+  // Atlas key and rendering transform of a glyph at a given position. x and y
+  // are moved as described for get_glyph()
+  GlyphKey glyph_key(unsigned int index, double &x, double &y,
+                     agg::trans_affine &mtx) {
+    GlyphKey key = {
+      current_face,
+      int(get_engine().height() * 64.0),
+      current_rot,
+      index,
+      0,
+      int(get_engine().rendering()),
+      0
+    };
+    mtx = current_mtx;
+    if (key.rendering == agg::glyph_ren_agg_gray8 ||
+        key.rendering == agg::glyph_ren_agg_mono) {
+      int x_bin = subpixel_bin(x);
+      int y_bin = free_rotation ? subpixel_bin(y) : 0;
+      key.bin = x_bin + y_bin * GLYPH_SUBPIXEL_BINS;
+      mtx *= agg::trans_affine_translation(double(x_bin) / GLYPH_SUBPIXEL_BINS,
+                                           double(y_bin) / GLYPH_SUBPIXEL_BINS);
+    }
+    return key;
+  }
+
+  // Render the glyphs of a run that are missing from the atlas on worker
+  // threads, so they are all found in the atlas when the run is drawn. Only
+  // done for bitmaps rasterized by AGG and if enough glyphs are missing
+  template<typename INDEX>
+  void prefetch_glyphs(const INDEX* ids, const double* x, const double* y,
+                       int n) {
+    if (get_glyph_workers().threads() < 2 || size_t(n) < GLYPH_PREFETCH_MIN) {
+      return;
+    }
+    agg::glyph_rendering rendering = get_engine().rendering();
+    if (rendering != agg::glyph_ren_agg_gray8 &&
+        rendering != agg::glyph_ren_agg_mono) {
+      return;
+    }
+    GlyphAtlas& atlas = get_glyph_atlas();
+    job_buffer.clear();
+    job_keys.clear();
+    for (int i = 0; i < n; ++i) {
+      double x_glyph = x[i];
+      double y_glyph = y[i];
+      GlyphJob job;
+      job.key = glyph_key(ids[i], x_glyph, y_glyph, job.mtx);
+      if (atlas.has(job.key)) {
+        continue;
+      }
+      if (job_keys.insert(job.key).second) {
+        job_buffer.push_back(job);
+      }
+    }
+    if (job_buffer.size() < GLYPH_PREFETCH_MIN) {
+      return;
+    }
+
+    get_glyph_workers().render(last_font, last_gren, get_engine().height(), job_buffer);
+
+    for (size_t i = 0; i < job_buffer.size(); ++i) {
+      GlyphJob& job = job_buffer[i];
+      if (!job.ok) {
+        continue;
+      }
+      agg::glyph_cache* glyph = atlas.insert(job.key, job.data.size());
+      std::copy(job.data.begin(), job.data.end(), glyph->data);
+      glyph->data_type = job.data_type;
+      glyph->bounds = job.bounds;
+      glyph->advance_x = job.advance_x;
+      glyph->advance_y = job.advance_y;
+    }
+  }
+
+  // Fetch the untransformed metrics of a glyph without rendering it
+  bool get_glyph_metrics(unsigned int index, GlyphMetrics &metrics) {
+    GlyphKey key = {
+      current_face,
+      int(get_engine().height() * 64.0),
+      0,
+      index,
+      0,
+      int(get_engine().rendering()),
+      0
+    };
+    if (get_metric_cache().glyphs.get(key, metrics)) {
+      return true;
+    }
+    if (!get_engine().prepare_glyph_metrics(index)) {
+      return false;
+    }
+    metrics.bounds = get_engine().bounds();
+    metrics.advance_x = get_engine().advance_x();
+    metrics.advance_y = get_engine().advance_y();
+    metrics.colour = get_engine().data_type() == agg::glyph_data_color;
+    get_metric_cache().glyphs.add(key, metrics);
+    return true;
+  }
+
+  // Render the gray8 glyphs collected so far. They are merged into a single
+  // pass, intersected with the clip path as they are merged, when that gives
+  // the same result as drawing them in sequence (see glyph_run_scanlines),
+  // i.e. for opaque text without a mask or custom blend mode
+  template<typename renderer_solid, typename raster, typename scanline>
+  void render_glyph_run(raster &ras_clip, scanline &sl, renderer_solid &ren_solid,
+                        bool clip) {
+    if (glyph_run.empty()) {
+      return;
+    }
+    typedef typename renderer_solid::base_ren_type::pixfmt_type pixfmt_type;
+    bool merge = std::is_same<scanline, agg::scanline_u8>::value &&
+      is_source_over<pixfmt_type>::value &&
+      ren_solid.color().a == renderer_solid::color_type::base_mask;
+    if (merge && clip) {
+      glyph_run_clipped<raster> clipped(glyph_run, ras_clip);
+      agg::render_scanlines(clipped, sl, ren_solid);
+    } else if (merge) {
+      agg::render_scanlines(glyph_run, sl, ren_solid);
+    } else {
+      for (size_t i = 0; i < glyph_run.size(); ++i) {
+        render<agg::scanline_u8>(glyph_run.glyph(i), ras_clip, sl, ren_solid, clip);
+      }
+    }
+    glyph_run.reset();
+  }
+
+  void init_adaptors(const agg::glyph_cache* glyph, double x, double y) {
+    if (glyph->data_type == agg::glyph_data_outline) {
+      path_adaptor.init(glyph->data, glyph->data_size, x, y, 1.0);
+    }
   }
 
   FontSettings get_font_file(const char* family, int bold, int italic,
@@ -512,6 +909,40 @@ private:
   void renderColourGlyph(const agg::glyph_cache* glyph, double x, double y,
                          double rot, ren &renderer, scanline &sl, double scaling, raster &ras_clip,
                          bool clip) {
+    const agg::glyph_cache* bitmap = get_colour_bitmap(glyph, x, y, rot, scaling);
+    if (bitmap == NULL) {
+      return;
+    }
+    render_bitmap(bitmap->data, int(x) + bitmap->bounds.x1,
+                  int(y) + bitmap->bounds.y1,
+                  bitmap->bounds.x2 - bitmap->bounds.x1,
+                  bitmap->bounds.y2 - bitmap->bounds.y1, ras_clip, sl,
+                  renderer, clip);
+  }
+
+  // Get a colour glyph scaled and rotated to its final device resolution and
+  // positioned at the closest subpixel offset. x and y are moved to the pixel
+  // the bitmap bounds are relative to. The bitmap is rendered on first use and
+  // stored in the glyph atlas
+  const agg::glyph_cache* get_colour_bitmap(const agg::glyph_cache* glyph,
+                                            double &x, double &y, double rot,
+                                            double scaling) {
+    int x_bin = subpixel_bin(x);
+    int y_bin = subpixel_bin(y);
+    GlyphKey key = {
+      current_face,
+      int(get_engine().height() * 64.0),
+      current_rot,
+      glyph->glyph_index,
+      x_bin + y_bin * GLYPH_SUBPIXEL_BINS,
+      GLYPH_DEVICE_BITMAP,
+      scaling > 0 ? int(std::lround(scaling * 65536.0)) : 0
+    };
+    const agg::glyph_cache* cached = get_glyph_atlas().find(key);
+    if (cached != NULL) {
+      return cached;
+    }
+
     int w = glyph->bounds.x2 - glyph->bounds.x1;
     int h = glyph->bounds.y1 - glyph->bounds.y2;
     agg::rendering_buffer rbuf(glyph->data, w, h, w * 4);
@@ -531,7 +962,39 @@ private:
     }
 #endif
     img_mtx *= agg::trans_affine_rotation(rot);
-    img_mtx *= agg::trans_affine_translation(x, y);
+    img_mtx *= agg::trans_affine_translation(double(x_bin) / GLYPH_SUBPIXEL_BINS,
+                                             double(y_bin) / GLYPH_SUBPIXEL_BINS);
+
+    // Find the pixel extent of the transformed glyph
+    double bx[4] = {0.0, double(w), double(w), 0.0};
+    double by[4] = {0.0, 0.0, double(h), double(h)};
+    double x1 = 1e100, y1 = 1e100, x2 = -1e100, y2 = -1e100;
+    for (int i = 0; i < 4; ++i) {
+      img_mtx.transform(&bx[i], &by[i]);
+      x1 = std::min(x1, bx[i]);
+      y1 = std::min(y1, by[i]);
+      x2 = std::max(x2, bx[i]);
+      y2 = std::max(y2, by[i]);
+    }
+    int b_x = std::floor(x1);
+    int b_y = std::floor(y1);
+    int b_w = std::ceil(x2) - b_x;
+    int b_h = std::ceil(y2) - b_y;
+
+    agg::glyph_cache* res = get_glyph_atlas().insert(key, b_w * b_h * 4);
+    res->data_type = agg::glyph_data_color;
+    res->bounds.x1 = b_x;
+    res->bounds.y1 = b_y;
+    res->bounds.x2 = b_x + b_w;
+    res->bounds.y2 = b_y + b_h;
+    res->advance_x = glyph->advance_x;
+    res->advance_y = glyph->advance_y;
+    memset(res->data, 0, res->data_size);
+    if (b_w <= 0 || b_h <= 0) {
+      return res;
+    }
+
+    img_mtx *= agg::trans_affine_translation(-b_x, -b_y);
     agg::trans_affine src_mtx = img_mtx;
     img_mtx.invert();
 
@@ -551,6 +1014,12 @@ private:
     ras.add_path(tr);
     bool interpolate = scaling >= 1 || scaling < 0;
 
-    render_raster<pixfmt_col_glyph, TARGET>(rbuf, w, h, ras, ras_clip, sl, interpolator, renderer, interpolate, clip, !interpolate);
+    agg::rendering_buffer res_buf(res->data, b_w, b_h, b_w * 4);
+    pixfmt_type_32 res_pixf(res_buf);
+    agg::renderer_base<pixfmt_type_32> res_ren(res_pixf);
+    agg::scanline_u8 res_sl;
+    render_raster<pixfmt_col_glyph, pixfmt_type_32>(rbuf, w, h, ras, ras, res_sl, interpolator, res_ren, interpolate, false, !interpolate);
+
+    return res;
   }
 };
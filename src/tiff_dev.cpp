@@ -6,15 +6,22 @@
 // [[export]]
 SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg, 
                 SEXP res, SEXP scaling, SEXP snap, SEXP bit, SEXP compression, 
-                SEXP encoding) {
+                SEXP encoding, SEXP tile, SEXP bigtiff, SEXP multipage, 
+                SEXP threads) {
   bool bit8 = INTEGER(bit)[0] == 8;
   int bgCol = RGBpar(bg, 0);
+  int tile_size = INTEGER(tile)[0];
+  bool big = LOGICAL(bigtiff)[0];
+  bool multi = LOGICAL(multipage)[0];
+  int n_threads = INTEGER(threads)[0];
+  
+  PageStorePtr store = page_store_for(file);
   
   BEGIN_CPP
   if (bit8) {
     if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
       AggDeviceTiffNoAlpha* device = new AggDeviceTiffNoAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
@@ -23,12 +30,17 @@ SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
         REAL(scaling)[0],
         LOGICAL(snap)[0],
         INTEGER(compression)[0],
-        INTEGER(encoding)[0]
+        INTEGER(encoding)[0],
+        tile_size,
+        big,
+        multi,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDeviceTiffNoAlpha>(device, "agg_tiff");
     } else {
       AggDeviceTiffAlpha* device = new AggDeviceTiffAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
@@ -37,14 +49,19 @@ SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
         REAL(scaling)[0],
         LOGICAL(snap)[0],
         INTEGER(compression)[0],
-        INTEGER(encoding)[0]
+        INTEGER(encoding)[0],
+        tile_size,
+        big,
+        multi,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDeviceTiffAlpha>(device, "agg_tiff");
     }
   } else {
     if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
       AggDeviceTiff16NoAlpha* device = new AggDeviceTiff16NoAlpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
@@ -53,12 +70,17 @@ SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
         REAL(scaling)[0],
         LOGICAL(snap)[0],
         INTEGER(compression)[0],
-        INTEGER(encoding)[0]
+        INTEGER(encoding)[0],
+        tile_size,
+        big,
+        multi,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDeviceTiff16NoAlpha>(device, "agg_tiff");
     } else {
       AggDeviceTiff16Alpha* device = new AggDeviceTiff16Alpha(
-        Rf_translateCharUTF8((STRING_ELT(file, 0))), 
+        page_file_name(file), 
         INTEGER(width)[0], 
         INTEGER(height)[0], 
         REAL(pointsize)[0], 
@@ -67,12 +89,17 @@ SEXP agg_tiff_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
         REAL(scaling)[0],
         LOGICAL(snap)[0],
         INTEGER(compression)[0],
-        INTEGER(encoding)[0]
+        INTEGER(encoding)[0],
+        tile_size,
+        big,
+        multi,
+        n_threads
       );
+      device->page_store = store;
       makeDevice<AggDeviceTiff16Alpha>(device, "agg_tiff");
     }
   }
   END_CPP
   
-  return R_NilValue;
+  return page_store_xptr(store);
 }
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <tiffio.h>
+
+#include "agg_rendering_buffer.h"
+
+// Amount of image data in a strip when strips are compressed in parallel
+static const size_t TIFF_PARALLEL_STRIP = 1 << 18;
+
+// The tags describing the pixels of a page. They are applied both to the file
+// and to the in-memory images used to encode strips and tiles on threads
+struct TiffFormat {
+  int n_comp;
+  int bits;
+  int compression;
+  int encoding;
+
+  void apply(TIFF* out) const {
+    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, n_comp);
+    if (n_comp == 4) {
+      short extras[] = {EXTRASAMPLE_ASSOCALPHA};
+      TIFFSetField(out, TIFFTAG_EXTRASAMPLES, 1, extras);
+    }
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bits);
+
+    // Compression
+    if (compression) TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+    if (encoding) TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+
+    // Required
+    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  }
+  size_t pixel_bytes() const {
+    return n_comp * bits / 8;
+  }
+};
+
+/* A TIFF file held in memory, used for pages that are not written to disk
+ * and to get at libtiff's codecs without touching the file being written.
+ * The data stays available after the TIFF handle is closed
+ */
+class TiffMemory {
+  std::vector<unsigned char> data;
+  toff_t pos;
+
+public:
+  TiffMemory() : pos(0) {}
+
+  TIFF* open(bool big = false) {
+    data.clear();
+    pos = 0;
+    return TIFFClientOpen("memory", big ? "w8" : "w", (thandle_t) this,
+                          read_proc, write_proc, seek_proc, close_proc,
+                          size_proc, map_proc, unmap_proc);
+  }
+  std::vector<unsigned char>& contents() {
+    return data;
+  }
+  const unsigned char* bytes() const {
+    return data.data();
+  }
+  size_t size() const {
+    return data.size();
+  }
+
+private:
+  static tmsize_t read_proc(thandle_t handle, void* buf, tmsize_t n) {
+    TiffMemory* mem = (TiffMemory*) handle;
+    if (mem->pos >= mem->data.size()) {
+      return 0;
+    }
+    n = std::min(n, tmsize_t(mem->data.size() - mem->pos));
+    std::memcpy(buf, mem->data.data() + mem->pos, n);
+    mem->pos += n;
+    return n;
+  }
+  static tmsize_t write_proc(thandle_t handle, void* buf, tmsize_t n) {
+    TiffMemory* mem = (TiffMemory*) handle;
+    if (mem->pos + n > mem->data.size()) {
+      mem->data.resize(mem->pos + n);
+    }
+    std::memcpy(mem->data.data() + mem->pos, buf, n);
+    mem->pos += n;
+    return n;
+  }
+  static toff_t seek_proc(thandle_t handle, toff_t off, int whence) {
+    TiffMemory* mem = (TiffMemory*) handle;
+    switch (whence) {
+    case SEEK_CUR:
+      mem->pos += off;
+      break;
+    case SEEK_END:
+      mem->pos = mem->data.size() + off;
+      break;
+    default:
+      mem->pos = off;
+      break;
+    }
+    return mem->pos;
+  }
+  static int close_proc(thandle_t) {
+    return 0;
+  }
+  static toff_t size_proc(thandle_t handle) {
+    return ((TiffMemory*) handle)->data.size();
+  }
+  static int map_proc(thandle_t, void**, toff_t*) {
+    return 0;
+  }
+  static void unmap_proc(thandle_t, void*, toff_t) {}
+};
+
+/* The image data of a page, split into strips or square tiles. Each chunk is
+ * copied out of the frame before it is encoded, as libtiff may modify the data
+ * it is given, and tiles at the right and bottom edge are padded to full size.
+ * With more than one thread the chunks are compressed in parallel: as codecs
+ * are bound to a TIFF handle, every chunk is written as the only strip of a
+ * small image in memory with the codec settings of the file, and the encoded
+ * bytes are read back. These are then written to the file in order with
+ * TIFFWriteRawStrip() or TIFFWriteRawTile(). JPEG compression keeps its
+ * tables outside the strips and is always encoded on a single thread
+ */
+class TiffChunks {
+  const TiffFormat& format;
+  const agg::rendering_buffer& frame;
+  int width;
+  int height;
+  int tile;
+  int rows_per_strip;
+  int across;
+  int n_chunks;
+
+public:
+  TiffChunks(const TiffFormat& format, const agg::rendering_buffer& frame,
+             int width, int height, int tile, int rows_per_strip) :
+    format(format),
+    frame(frame),
+    width(width),
+    height(height),
+    tile(tile),
+    rows_per_strip(rows_per_strip)
+  {
+    if (tile > 0) {
+      across = (width + tile - 1) / tile;
+      n_chunks = across * ((height + tile - 1) / tile);
+    } else {
+      across = 1;
+      n_chunks = (height + rows_per_strip - 1) / rows_per_strip;
+    }
+  }
+
+  // The number of rows per strip to use when compressing in parallel
+  static int parallel_rows(int width, const TiffFormat& format) {
+    size_t row_bytes = size_t(width) * format.pixel_bytes();
+    return std::max(1, int(TIFF_PARALLEL_STRIP / row_bytes));
+  }
+
+  bool write(TIFF* out, int threads) {
+    if (threads > 1 && n_chunks > 1 && format.compression != 0 &&
+        format.compression != COMPRESSION_JPEG) {
+      return write_parallel(out, threads);
+    }
+    std::vector<unsigned char> buffer;
+    for (int i = 0; i < n_chunks; ++i) {
+      copy(i, buffer);
+      tmsize_t size = buffer.size();
+      tmsize_t written = tile > 0 ?
+        TIFFWriteEncodedTile(out, i, buffer.data(), size) :
+        TIFFWriteEncodedStrip(out, i, buffer.data(), size);
+      if (written < 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  // Copy a chunk into buffer and return the number of rows in it
+  int copy(int i, std::vector<unsigned char>& buffer) const {
+    size_t bpp = format.pixel_bytes();
+    if (tile > 0) {
+      int x0 = (i % across) * tile;
+      int y0 = (i / across) * tile;
+      size_t line = tile * bpp;
+      size_t n = size_t(std::min(tile, width - x0)) * bpp;
+      buffer.assign(line * tile, 0);
+      for (int y = y0; y < std::min(height, y0 + tile); ++y) {
+        std::memcpy(buffer.data() + (y - y0) * line, frame.row_ptr(y) + x0 * bpp, n);
+      }
+      return tile;
+    }
+    int y0 = i * rows_per_strip;
+    int rows = std::min(rows_per_strip, height - y0);
+    size_t line = width * bpp;
+    buffer.resize(line * rows);
+    for (int y = 0; y < rows; ++y) {
+      std::memcpy(buffer.data() + y * line, frame.row_ptr(y0 + y), line);
+    }
+    return rows;
+  }
+
+  // Encode a chunk with the codec of the file
+  bool encode(int i, std::vector<unsigned char>& buffer, TiffMemory& mem,
+              std::vector<unsigned char>& out) const {
+    int rows = copy(i, buffer);
+    TIFF* tif = mem.open();
+    if (!tif) {
+      return false;
+    }
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, tile > 0 ? tile : width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, rows);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+    format.apply(tif);
+    bool ok = TIFFWriteEncodedStrip(tif, 0, buffer.data(), buffer.size()) >= 0;
+    toff_t* offsets = NULL;
+    toff_t* counts = NULL;
+    ok = ok && TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets) &&
+      TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &counts) &&
+      offsets[0] + counts[0] <= mem.size();
+    if (ok) {
+      out.assign(mem.bytes() + offsets[0], mem.bytes() + offsets[0] + counts[0]);
+    }
+    // The directory of the memory image is never needed
+    TIFFCleanup(tif);
+    return ok;
+  }
+
+  bool write_parallel(TIFF* out, int threads) {
+    std::vector< std::vector<unsigned char> > encoded(n_chunks);
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+
+    auto work = [&]() {
+      try {
+        std::vector<unsigned char> buffer;
+        TiffMemory mem;
+        for (int i = next++; i < n_chunks && !failed; i = next++) {
+          if (!encode(i, buffer, mem, encoded[i])) {
+            failed = true;
+          }
+        }
+      } catch (...) {
+        failed = true;
+      }
+    };
+
+    std::vector<std::thread> pool;
+    threads = std::min(threads, n_chunks);
+    for (int i = 1; i < threads; ++i) {
+      try {
+        pool.emplace_back(work);
+      } catch (...) {
+        break;
+      }
+    }
+    work();
+    for (size_t i = 0; i < pool.size(); ++i) {
+      pool[i].join();
+    }
+    if (failed) {
+      return false;
+    }
+
+    for (int i = 0; i < n_chunks; ++i) {
+      tmsize_t size = encoded[i].size();
+      tmsize_t written = tile > 0 ?
+        TIFFWriteRawTile(out, i, encoded[i].data(), size) :
+        TIFFWriteRawStrip(out, i, encoded[i].data(), size);
+      if (written != size) {
+        return false;
+      }
+      std::vector<unsigned char>().swap(encoded[i]);
+    }
+    return true;
+  }
+};
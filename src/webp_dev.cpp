@@ -9,10 +9,12 @@ SEXP agg_webp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
   bool los = LOGICAL(lossy)[0];
   int qual = INTEGER(quality)[0];
 
+  PageStorePtr store = page_store_for(file);
+
   BEGIN_CPP
   if (R_OPAQUE(bgCol)) { // Opaque bg... no need for alpha channel
     AggDeviceWebPNoAlpha* device = new AggDeviceWebPNoAlpha(
-      Rf_translateCharUTF8((STRING_ELT(file, 0))),
+      page_file_name(file),
       INTEGER(width)[0],
       INTEGER(height)[0],
       REAL(pointsize)[0],
@@ -23,10 +25,11 @@ SEXP agg_webp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
       los,
       qual
     );
+    device->page_store = store;
     makeDevice<AggDeviceWebPNoAlpha>(device, "agg_webp");
   } else {
     AggDeviceWebPAlpha* device = new AggDeviceWebPAlpha(
-      Rf_translateCharUTF8((STRING_ELT(file, 0))),
+      page_file_name(file),
       INTEGER(width)[0],
       INTEGER(height)[0],
       REAL(pointsize)[0],
@@ -37,9 +40,10 @@ SEXP agg_webp_c(SEXP file, SEXP width, SEXP height, SEXP pointsize, SEXP bg,
       los,
       qual
     );
+    device->page_store = store;
     makeDevice<AggDeviceWebPAlpha>(device, "agg_webp");
   }
   END_CPP
 
-  return R_NilValue;
+  return page_store_xptr(store);
 }